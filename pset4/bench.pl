@@ -0,0 +1,230 @@
+#! /usr/bin/perl -w
+
+# bench.pl
+#    This program benchmarks the io61 tools against every backend (io61,
+#    stdio, syscall, slow) over a matrix of file sizes, block sizes,
+#    strides, pipe buffer sizes, and (for io61) direct I/O, and writes one
+#    CSV row per run.
+#    Each row reports the best of TRIALS runs in MB/s, plus two system
+#    call counts: `io61_calls`, the reads, writes, seeks, and kernel
+#    copies io61 itself reports under IO61_STATS (io61 backend only), and
+#    `strace_calls`, every system call `strace -c` sees (all backends,
+#    when strace is installed). Only `strace_calls` compares across
+#    backends.
+#
+#    Settings come from the environment (comma-separated lists):
+#      BENCH_TOOLS     tools to run (default cat61,blockcat61,reverse61,
+#                      stridecat61,reordercat61,scattergather61)
+#      BENCH_BACKENDS  backends (default io61,stdio,syscall,slow)
+#      BENCH_SIZES     input sizes, passed as `-s` where supported
+#                      (default 1m,16m; suffixes k, m, g)
+#      BENCH_BLOCKS    `-b` values (default 1,512,4096,65536)
+#      BENCH_STRIDES   `-t` values (default 1024,65536)
+#      BENCH_PIPEBUFS  `-B` values; 0 reads from a regular file, anything
+#                      else pipes the input in (default 0,65536)
+#      BENCH_DIRECT    0 for buffered I/O, 1 for O_DIRECT (`-O`, io61 only);
+#                      `BENCH_SIZES=4g BENCH_DIRECT=0,1` compares the two
+#                      on large files (default 0)
+#      BENCH_OUT       CSV file (default bench.csv)
+#      TRIALS          runs per setting (default 3)
+#      MAXTIME         seconds before a run is killed (default 20)
+#
+#    Run it with `make bench`.
+
+use Time::HiRes;
+
+sub nonemptyenv ($) {
+    my ($e) = @_;
+    return exists($ENV{$e}) && $ENV{$e} ne "" && $ENV{$e} ne " ";
+}
+
+sub listenv ($$) {
+    my ($e, $default) = @_;
+    return split(/[,\s]+/, nonemptyenv($e) ? $ENV{$e} : $default);
+}
+
+sub parse_size ($) {
+    my ($s) = @_;
+    die "*** $s: invalid size\n" if $s !~ /\A(\d+)([kmg]?)\z/i;
+    my ($n, $unit) = ($1, lc($2));
+    $n *= 1024 if $unit ne "";
+    $n *= 1024 if $unit eq "m" || $unit eq "g";
+    $n *= 1024 if $unit eq "g";
+    return $n;
+}
+
+# which options each tool understands
+my (%TOOLOPTS) = (
+    "cat61" => "sO",
+    "blockcat61" => "bBO",
+    "reverse61" => "s",
+    "stridecat61" => "bts",
+    "reordercat61" => "bs",
+    "scattergather61" => "b"
+);
+
+my (@tools) = listenv("BENCH_TOOLS", join(",", sort(keys(%TOOLOPTS))));
+my (@backends) = listenv("BENCH_BACKENDS", "io61,stdio,syscall,slow");
+my (@sizes) = listenv("BENCH_SIZES", "1m,16m");
+my (@blocks) = listenv("BENCH_BLOCKS", "1,512,4096,65536");
+my (@strides) = listenv("BENCH_STRIDES", "1024,65536");
+my (@pipebufs) = listenv("BENCH_PIPEBUFS", "0,65536");
+my (@directs) = listenv("BENCH_DIRECT", "0");
+my ($out) = nonemptyenv("BENCH_OUT") ? $ENV{"BENCH_OUT"} : "bench.csv";
+my ($trials) = nonemptyenv("TRIALS") ? int($ENV{"TRIALS"}) : 3;
+my ($maxtime) = nonemptyenv("MAXTIME") ? $ENV{"MAXTIME"} + 0 : 20;
+$trials = 3 if $trials <= 0;
+$maxtime = 20 if $maxtime <= 0;
+my ($strace) = (grep { -x $_ } map { "$_/strace" } split(/:/, $ENV{"PATH"}))[0];
+
+foreach my $t (@tools) {
+    die "*** $t: unknown tool\n" if !exists($TOOLOPTS{$t});
+}
+foreach my $b (@backends) {
+    die "*** $b: unknown backend\n" if $b !~ /\A(?:io61|stdio|syscall|slow)\z/;
+}
+
+# create data files the same way check.pl does
+die "*** Cannot create \`files\` directory.\n"
+    if !-d "files" && (-e "files" || !mkdir("files"));
+
+sub make_datafile ($) {
+    my ($size) = @_;
+    my ($fn) = "files/bench$size.txt";
+    if (!-r $fn || -s $fn != $size) {
+        truncate($fn, 0) if -e $fn;
+        while (!defined(-s $fn) || -s $fn < $size) {
+            system("cat /usr/share/dict/words >> $fn") == 0
+                or die "*** Cannot create $fn.\n";
+        }
+        truncate($fn, $size);
+    }
+    return $fn;
+}
+
+sub program ($$) {
+    my ($backend, $tool) = @_;
+    return $backend eq "io61" ? "./$tool" : "./$backend-$tool";
+}
+
+sub command ($$$$$$$$) {
+    my ($backend, $tool, $infile, $size, $block, $stride, $pipebuf, $direct) = @_;
+    my ($opts) = $TOOLOPTS{$tool};
+    my ($cmd) = program($backend, $tool);
+    $cmd .= " -s $size" if $opts =~ /s/;
+    $cmd .= " -b $block" if $opts =~ /b/;
+    $cmd .= " -t $stride" if $opts =~ /t/;
+    $cmd .= " -B $pipebuf" if $opts =~ /B/ && $pipebuf;
+    $cmd .= " -O" if $direct;
+    if ($tool eq "scattergather61") {
+        $cmd .= " -i $infile -o files/bench-out.txt";
+    } elsif ($pipebuf) {
+        $cmd = "cat $infile | $cmd -o files/bench-out.txt";
+    } else {
+        $cmd .= " -o files/bench-out.txt $infile";
+    }
+    return $cmd;
+}
+
+# run_timed($cmd)
+#    Runs `$cmd` under a time limit and returns its elapsed time, or
+#    undef if it failed or was killed.
+sub run_timed ($) {
+    my ($cmd) = @_;
+    my ($t0) = Time::HiRes::time();
+    my ($status) = system("timeout -s KILL $maxtime sh -c '$cmd' >/dev/null 2>&1");
+    my ($t1) = Time::HiRes::time();
+    return $status == 0 ? $t1 - $t0 : undef;
+}
+
+# count_io61_calls($backend, $cmd)
+#    Returns the number of reads, writes, seeks, and kernel copies io61
+#    reports making for `$cmd` under IO61_STATS, or "" for other backends.
+sub count_io61_calls ($$) {
+    my ($backend, $cmd) = @_;
+    return "" if $backend ne "io61";
+    my ($stats) = scalar `IO61_STATS=1 timeout -s KILL $maxtime sh -c '$cmd' 2>&1 >/dev/null`;
+    return "" if $? != 0;
+    my ($n) = 0;
+    while ($stats =~ /io61 fd \d+ \(\w+\): (\d+) reads .*?, (\d+) writes .*?, (\d+) seeks, (\d+) transfers/g) {
+        $n += $1 + $2 + $3 + $4;
+    }
+    return $n;
+}
+
+# count_strace_calls($cmd)
+#    Returns the total number of system calls `strace -c` counts for
+#    `$cmd`'s tool, whatever its backend, or "" if strace is missing.
+sub count_strace_calls ($) {
+    my ($cmd) = @_;
+    return "" if !$strace;
+    my ($prog) = $cmd =~ m{(\./\S+61)};
+    $cmd =~ s{\./\S+61}{$strace -f -c -o files/bench-strace.txt $prog};
+    return "" if system("timeout -s KILL $maxtime sh -c '$cmd' >/dev/null 2>&1") != 0;
+    open(STRACE, "<", "files/bench-strace.txt") or return "";
+    my ($n) = "";
+    while (<STRACE>) {
+        $n = $1 if /\A[\d.\s]+?\s(\d+)\s+(?:\d+\s+)?total\s*\z/;
+    }
+    close(STRACE);
+    return $n;
+}
+
+# build every program we need
+my (@programs);
+foreach my $tool (@tools) {
+    push @programs, map { program($_, $tool) } @backends;
+}
+system("make", "-s", map { substr($_, 2) } @programs) == 0
+    or die "*** make failed\n";
+
+open(CSV, ">", $out) or die "*** $out: $!\n";
+print CSV "tool,backend,size,block,stride,pipebuf,direct,seconds,mbps,io61_calls,strace_calls\n";
+my ($nruns) = 0;
+
+foreach my $sizestr (@sizes) {
+    my ($size) = parse_size($sizestr);
+    my ($infile) = make_datafile($size);
+    foreach my $tool (@tools) {
+        my ($opts) = $TOOLOPTS{$tool};
+        foreach my $block ($opts =~ /b/ ? @blocks : ("")) {
+            foreach my $stride ($opts =~ /t/ ? @strides : ("")) {
+                foreach my $pipebuf ($opts =~ /B/ ? @pipebufs : (0)) {
+                    foreach my $direct ($opts =~ /O/ ? @directs : (0)) {
+                        foreach my $backend (@backends) {
+                            # direct I/O needs a regular file and the io61 cache
+                            next if $direct && ($pipebuf || $backend ne "io61");
+                            my ($cmd) = command($backend, $tool, $infile, $size,
+                                                $block, $stride, $pipebuf, $direct);
+                            my ($best);
+                            for (my $i = 0; $i < $trials; ++$i) {
+                                my ($t) = run_timed($cmd);
+                                last if !defined($t);
+                                $best = $t if !defined($best) || $t < $best;
+                            }
+                            my ($secs, $mbps, $nio61, $nstrace) = ("", "", "", "");
+                            if (defined($best)) {
+                                $secs = sprintf("%.6f", $best);
+                                $mbps = sprintf("%.2f", $size / $best / 1e6);
+                                $nio61 = count_io61_calls($backend, $cmd);
+                                $nstrace = count_strace_calls($cmd);
+                            }
+                            print CSV join(",", $tool, $backend, $size, $block,
+                                           $stride, $pipebuf, $direct, $secs,
+                                           $mbps, $nio61, $nstrace), "\n";
+                            printf STDERR "%-16s %-8s size %-10d b %-6s t %-6s B %-6s O %s %s\n",
+                                $tool, $backend, $size, $block, $stride,
+                                $pipebuf, $direct,
+                                defined($best) ? "$mbps MB/s" : "FAILED/TIMEOUT";
+                            ++$nruns;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+close(CSV);
+unlink("files/bench-out.txt", "files/bench-strace.txt");
+print STDERR "$nruns runs written to $out\n";
@@ -1,12 +1,16 @@
 #include "io61.hh"
 
-// Usage: ./blockcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
+// Usage: ./blockcat61 [-b BLOCKSIZE] [-B PIPEBUFSIZE] [-l] [-O] [-R] [-U] [-Z] [-o OUTFILE] [FILE]
 //    Copies the input FILE to standard output in blocks.
-//    Default BLOCKSIZE is 4096.
+//    Default BLOCKSIZE is 4096. With `-l`, copies a line at a time
+//    (lines longer than BLOCKSIZE are split). With `-O`, bypasses the page
+//    cache with O_DIRECT. With `-R`, reads ahead in a background
+//    thread; with `-U`, reads and writes through io_uring. With `-Z`, lets
+//    the kernel copy the data instead (see `io61_transfer`).
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:o:i:D:Fy", 4096).parse(argc, argv);
+    io61_args args = io61_args("b:o:i:D:B:lORUZFy", 4096).parse(argc, argv);
 
     // Allocate buffer, open files
     unsigned char* buf = new unsigned char[args.block_size];
@@ -17,8 +21,19 @@ int main(int argc, char* argv[]) {
     args.after_open(outf, O_WRONLY);
 
     // Copy file data
-    while (true) {
-        ssize_t nr = io61_read(inf, buf, args.block_size);
+    while (args.transfer) {
+        ssize_t n = io61_transfer(inf, outf, SIZE_MAX);
+        if (n <= 0) {
+            break;
+        }
+    }
+    while (!args.transfer) {
+        ssize_t nr;
+        if (args.lines) {
+            nr = io61_readline(inf, buf, args.block_size);
+        } else {
+            nr = io61_read(inf, buf, args.block_size);
+        }
         if (nr <= 0) {
             break;
         }
@@ -7,6 +7,12 @@ ifeq ($(filter 0 1 2 3 s z g fast,$(O)),$(strip $(O)))
 override O := -O$(O)
 endif
 
+PTHREAD ?= 0
+ifeq ($(PTHREAD),1)
+CFLAGS += -pthread
+CXXFLAGS += -pthread
+endif
+
 # skip x86 versions in ARM Docker
 X86 ?= 0
 ifneq ($(X86),1)
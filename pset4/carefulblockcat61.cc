@@ -1,10 +1,12 @@
 #include "io61.hh"
+#include <poll.h>
 
 // Usage: ./blockcat61 [-b BLOCKSIZE] [-o OUTFILE] [FILE]
 //    Copies the input FILE to standard output in blocks.
 //    Default BLOCKSIZE is 4096.
 //    Unlike `blockcat61`, this program retries on recoverable
-//    errors (EINTR and EAGAIN).
+//    errors (EINTR and EAGAIN), waiting for the file to become ready
+//    after EAGAIN.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
@@ -23,6 +25,9 @@ int main(int argc, char* argv[]) {
     reread:
         ssize_t nr = io61_read(inf, buf, args.block_size);
         if (nr == -1 && (errno == EINTR || errno == EAGAIN)) {
+            if (errno == EAGAIN) {
+                io61_wait_ready(inf, POLLIN);
+            }
             goto reread;
         } else if (nr <= 0) {
             break;
@@ -33,6 +38,9 @@ int main(int argc, char* argv[]) {
         rewrite:
             ssize_t nw = io61_write(outf, buf + pos, nr - pos);
             if (nw == -1 && (errno == EINTR || errno == EAGAIN)) {
+                if (errno == EAGAIN) {
+                    io61_wait_ready(outf, POLLOUT);
+                }
                 goto rewrite;
             }
             assert(nw > 0);
@@ -1,24 +1,41 @@
 #include "io61.hh"
+#include <poll.h>
 
-// Usage: ./carefulcat61 [-s SIZE] [-o OUTFILE] [-n] [FILE]
+// Usage: ./carefulcat61 [-s SIZE] [-o OUTFILE] [-n] [-Z] [FILE]
 //    Copies the input FILE to OUTFILE one character at a time.
 //    Unlike `cat61`, this program retries on recoverable errors
-//    (EINTR and EAGAIN).
+//    (EINTR and EAGAIN), waiting for the file to become ready after
+//    EAGAIN. With `-Z`, lets the kernel copy the data instead (see
+//    `io61_transfer`).
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("s:o:i:D:B:a:nFy").parse(argc, argv);
+    io61_args args = io61_args("s:o:i:D:B:a:nZFy").parse(argc, argv);
 
     io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
     io61_file* outf = io61_open_check(args.output_file,
                                       O_WRONLY | O_CREAT | O_TRUNC);
     args.after_open();
 
-    while (args.file_size != 0) {
+    while (args.transfer && args.file_size != 0) {
+        errno = 0;
+        ssize_t n = io61_transfer(inf, outf, args.file_size);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        args.file_size -= n;
+    }
+
+    while (!args.transfer && args.file_size != 0) {
     reread:
         errno = 0;
         int ch = io61_readc(inf);
         if (ch == EOF && (errno == EINTR || errno == EAGAIN)) {
+            if (errno == EAGAIN) {
+                io61_wait_ready(inf, POLLIN);
+            }
             goto reread;
         } else if (ch == EOF) {
             break;
@@ -28,6 +45,9 @@ int main(int argc, char* argv[]) {
         errno = 0;
         int r = io61_writec(outf, ch);
         if (r == EOF && (errno == EINTR || errno == EAGAIN)) {
+            if (errno == EAGAIN) {
+                io61_wait_ready(outf, POLLOUT);
+            }
             goto rewrite;
         }
         assert(r == 0);
@@ -1,18 +1,53 @@
 #include "io61.hh"
 
-// Usage: ./cat61 [-s SIZE] [-o OUTFILE] [FILE]
+// Usage: ./cat61 [-s SIZE] [-O] [-R] [-Z] [-W] [-o OUTFILE] [FILE]
 //    Copies the input FILE to OUTFILE one character at a time.
+//    With `-O`, bypasses the page cache with O_DIRECT (see
+//    `io61_set_direct`). With `-R`, reads ahead in a background thread.
+//    With `-Z`, lets the kernel copy the data instead (see
+//    `io61_transfer`). With `-W`, copies directly between the caches
+//    with `io61_peek` and `io61_reserve`.
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("s:o:i:D:a:Fy").parse(argc, argv);
+    io61_args args = io61_args("s:o:i:D:a:ORZWFy").parse(argc, argv);
 
     io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
     io61_file* outf = io61_open_check(args.output_file,
                                       O_WRONLY | O_CREAT | O_TRUNC);
-    args.after_open();
+    args.after_open(inf, O_RDONLY);
+    args.after_open(outf, O_WRONLY);
 
-    while (args.file_size != 0) {
+    while (args.transfer && args.file_size != 0) {
+        ssize_t n = io61_transfer(inf, outf, args.file_size);
+        if (n <= 0) {
+            break;
+        }
+        args.file_size -= n;
+    }
+
+    while (args.window && args.file_size != 0) {
+        const unsigned char* in;
+        ssize_t nin = io61_peek(inf, &in);
+        if (nin <= 0) {
+            break;
+        }
+
+        unsigned char* out;
+        ssize_t nout = io61_reserve(outf, &out);
+        assert(nout > 0);
+
+        size_t n = std::min(std::min((size_t) nin, (size_t) nout), args.file_size);
+        memcpy(out, in, n);
+        io61_consume(inf, n);
+        int r = io61_commit(outf, n);
+        assert(r == 0);
+        args.file_size -= n;
+
+        args.after_write(outf);
+    }
+
+    while (!args.transfer && !args.window && args.file_size != 0) {
         int ch = io61_readc(inf);
         if (ch == EOF) {
             break;
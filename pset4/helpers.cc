@@ -1,8 +1,10 @@
 #include "io61.hh"
+#include <ctime>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <csignal>
 #include <cerrno>
+#include <poll.h>
 
 // helpers.cc
 //    The io61_args() structure parses command line arguments.
@@ -56,6 +58,16 @@ double monotonic_timestamp() {
 }
 
 
+// io61_wait_ready(f, events)
+//    Blocks until `f`'s file descriptor is ready for `events` (`POLLIN`
+//    or `POLLOUT`). Careful tools call this after EAGAIN.
+
+void io61_wait_ready(io61_file* f, short events) {
+    struct pollfd pfd = { io61_fileno(f), events, 0 };
+    (void) poll(&pfd, 1, -1);
+}
+
+
 // io61_args functions
 
 io61_args::io61_args(const char* opts_, size_t block_size_)
@@ -117,6 +129,21 @@ io61_args& io61_args::parse(int argc, char** argv) {
         case 'n':
             this->nonblocking = true;
             break;
+        case 'R':
+            this->readahead = true;
+            break;
+        case 'U':
+            this->uring = true;
+            break;
+        case 'Z':
+            this->transfer = true;
+            break;
+        case 'W':
+            this->window = true;
+            break;
+        case 'O':
+            this->direct = true;
+            break;
         case 'q':
             this->quiet = true;
             break;
@@ -243,6 +270,21 @@ void io61_args::usage() {
     if (strchr(this->opts, 'B')) {
         fprintf(stderr, "    -B BUFSIZ     Set input pipe buffer size on Linux\n");
     }
+    if (strchr(this->opts, 'R')) {
+        fprintf(stderr, "    -R            Read ahead in a background thread\n");
+    }
+    if (strchr(this->opts, 'U')) {
+        fprintf(stderr, "    -U            Batch reads and writes with io_uring\n");
+    }
+    if (strchr(this->opts, 'Z')) {
+        fprintf(stderr, "    -Z            Copy inside the kernel with io61_transfer\n");
+    }
+    if (strchr(this->opts, 'O')) {
+        fprintf(stderr, "    -O            Bypass the page cache with O_DIRECT\n");
+    }
+    if (strchr(this->opts, 'W')) {
+        fprintf(stderr, "    -W            Copy cache windows with io61_peek/io61_reserve\n");
+    }
     if (strchr(this->opts, 'r')) {
         fprintf(stderr, "    -r            Set random seed (default %u)\n", this->seed);
     }
@@ -283,6 +325,25 @@ void io61_args::after_open(int fd, int mode) {
 
 void io61_args::after_open(io61_file* f, int mode) {
     this->after_open(io61_fileno(f), mode);
+    if (this->pipebuf_size > 0) {
+        // pick a cache size that matches the new pipe buffer
+        int r = io61_set_bufsize(f, 0);
+        (void) r;
+    }
+    if (this->readahead && (mode & O_ACCMODE) == O_RDONLY) {
+        int r = io61_set_readahead(f, 1);
+        assert(r == 0);
+    }
+    if (this->uring) {
+        // falls back to ordinary system calls if io_uring is unavailable
+        int r = io61_set_uring(f, 1);
+        (void) r;
+    }
+    if (this->direct) {
+        // falls back to buffered I/O where O_DIRECT is unsupported
+        int r = io61_set_direct(f, 1);
+        (void) r;
+    }
 }
 
 void io61_args::after_open(FILE* f, int mode) {
@@ -1,10 +1,20 @@
 #include "io61.hh"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 #include <climits>
 #include <cerrno>
 #include <iostream>
 #include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 // io61.cc
 //    YOUR CODE HERE!
@@ -12,24 +22,137 @@
 // Define NUL character for /dev/zero
 #define NUL '\0'
 
+// io61_readahead
+//    State for a read cache's background read-ahead thread. The thread
+//    fills `buf` while the caller consumes the cache; `io61_fill` then
+//    swaps the two buffers.
+struct io61_readahead {
+    std::thread th;                             // Background reader
+    std::mutex m;                               // Protects everything below
+    std::condition_variable cv;                 // Signals `pending`, `ready`, `stop` changes
+    unsigned char* buf = nullptr;               // Back buffer filled by `th`
+    size_t bufsize = 0;                         // Bytes to read into `buf`
+    ssize_t nr = 0;                             // Result of the last background read
+    int err = 0;                                // `errno` of the last background read
+    bool pending = false;                       // A read has been requested but not finished
+    bool ready = false;                         // `buf` holds a finished read
+    bool stop = false;                          // `th` should exit
+
+    ~io61_readahead() {
+        delete[] buf;
+    }
+};
+
+// io61_uring_slot
+//    Per-cache state for the io_uring backend (see `io61_set_uring`). Each
+//    cache owns one spare buffer. An asynchronous read fills it with the
+//    data that follows the cache; an asynchronous write drains it while
+//    the cache takes new data. At most one operation per cache is in flight.
+struct io61_uring_slot {
+    bool enabled = false;                       // Use io_uring for this cache
+    unsigned char* buf = nullptr;               // Spare buffer (owned by the in-flight operation)
+    size_t len = 0;                             // Length of the in-flight operation
+    bool inflight = false;                      // An operation has been queued...
+    bool done = false;                          // ...and a read completed with result `res`
+    ssize_t res = 0;
+    bool streaming = false;                     // Last fill was full, with no seek since
+    int err = 0;                                // Deferred write error (`errno` value)
+};
+
+// io61_stats
+//    Per-file counters, printed by `io61_close` when `IO61_STATS` is set in
+//    the environment. A hit is an io61 read or write call served entirely
+//    by the cache; a miss needed at least one fill, flush, or bypass.
+//    `blocked` is time spent waiting in system calls (including waits for
+//    read-ahead and io_uring), and is measured only when `IO61_STATS` is set.
+struct io61_stats {
+    unsigned long nreads = 0;                   // Read system calls
+    unsigned long nwrites = 0;                  // Write system calls
+    unsigned long nseeks = 0;                   // `lseek` calls
+    unsigned long ntransfers = 0;               // Kernel copies (output side)
+    unsigned long long bytes_read = 0;
+    unsigned long long bytes_written = 0;
+    unsigned long hits = 0;
+    unsigned long misses = 0;
+    unsigned long nflushes = 0;
+    double blocked = 0;                         // Seconds
+};
+
+static bool io61_stats_on = false;
+
+// io61_pool
+//    Free list of page-aligned cache buffers for direct I/O (see
+//    `io61_set_direct`). O_DIRECT transfers need aligned memory, and
+//    fresh multi-megabyte buffers cost a page fault per page on first
+//    use, so buffers of closed files are kept for the next one.
+static constexpr size_t io61_direct_align = 4096;
+static constexpr size_t io61_direct_bufsize = 1 << 20;
+static constexpr size_t io61_pool_max = 8;
+static std::vector<std::pair<size_t, unsigned char*>> io61_pool;
+
+// io61_pool_get(sz)
+//   Returns an aligned buffer of `sz` bytes, a multiple of
+//   `io61_direct_align`, reusing a pooled one if possible.
+static unsigned char* io61_pool_get(size_t sz) {
+    for (auto it = io61_pool.begin(); it != io61_pool.end(); ++it) {
+        if (it->first == sz) {
+            unsigned char* buf = it->second;
+            io61_pool.erase(it);
+            return buf;
+        }
+    }
+    void* buf;
+    if (posix_memalign(&buf, io61_direct_align, sz) != 0) {
+        throw std::bad_alloc();
+    }
+    return (unsigned char*) buf;
+}
+
+// io61_pool_put(buf, sz)
+//   Returns `buf`, which came from `io61_pool_get(sz)`, to the pool.
+static void io61_pool_put(unsigned char* buf, size_t sz) {
+    if (io61_pool.size() < io61_pool_max) {
+        io61_pool.emplace_back(sz, buf);
+    } else {
+        free(buf);
+    }
+}
+
 // io61_cache
 //    Data structure for io61 caches
 struct io61_fcache {
     int fd = -1;                                // File descriptor of file associated w/cache
-    static constexpr off_t bufsize = 8192;      // Each block is 8192 bytes
+    off_t bufsize = 8192;                       // Size of `cbuf` (see `io61_default_bufsize`)
     size_t filesize = -1;                       // Size of file cached
-    unsigned char cbuf[bufsize];                // Cached data is stored in `cbuf`
+    unsigned char* cbuf = nullptr;              // Cached data is stored in `cbuf`
     off_t tag = 0;                              // `tag`: File offset of first byte of cached data (0 when file is opened).
     off_t end_tag = 0;                          // `end_tag`: File offset one past the last byte of cached data (0 when file is opened).
     off_t pos_tag = 0;                          // `pos_tag`: Cache position: file offset of the cache.
     int mode;                                   // File mode (read or write)
     bool is_dev_zero = false;
+    io61_readahead* ra = nullptr;               // Read-ahead state, if enabled (see `io61_set_readahead`)
+    io61_uring_slot u;                          // io_uring state
+    io61_stats st;                              // Counters (see `io61_stats`)
+    bool direct = false;                        // Use O_DIRECT (see `io61_set_direct`)
+    bool odirect = false;                       // O_DIRECT is currently set on `fd`
+    bool pooled = false;                        // `cbuf` came from `io61_pool_get`
+
+    ~io61_fcache() {
+        if (pooled) {
+            io61_pool_put(cbuf, bufsize);
+        } else {
+            delete[] cbuf;
+        }
+        delete[] u.buf;
+    }
 };
 
 // Initialize maps from file descriptor to associated cache
 std::unordered_map<int, io61_fcache*> read_caches;
 std::unordered_map<int, io61_fcache*> write_caches;
 
+static int io61_uring_settle(io61_fcache* cache);
+
 // io61_file
 //    Data structure for io61 file wrappers. Add your own stuff.
 
@@ -39,6 +162,85 @@ struct io61_file {
 };
 
 
+// io61_now()
+//   Returns the current time when statistics are on, and 0 otherwise, so
+//   blocked-time accounting costs nothing unless requested.
+static double io61_now() {
+    return io61_stats_on ? monotonic_timestamp() : 0;
+}
+
+// io61_print_stats(cache)
+//   Prints the counters for `cache` to standard error.
+static void io61_print_stats(io61_fcache* cache) {
+    const io61_stats& st = cache->st;
+    fprintf(stderr, "io61 fd %d (%s): %lu reads %llu bytes, %lu writes %llu bytes, "
+            "%lu seeks, %lu transfers, %lu flushes, %lu hits, %lu misses, "
+            "%.6fs blocked\n",
+            cache->fd, cache->mode == O_RDONLY ? "read" : "write",
+            st.nreads, st.bytes_read, st.nwrites, st.bytes_written,
+            st.nseeks, st.ntransfers, st.nflushes, st.hits, st.misses,
+            st.blocked);
+}
+
+
+// io61_poll(fd, events)
+//   Blocks until `fd` is ready for `events` (`POLLIN` or `POLLOUT`). Used
+//   instead of retrying a system call that failed with EAGAIN, so waiting
+//   on a slow nonblocking pipe or socket doesn't burn the CPU. Returns 0
+//   on success and -1 on error.
+static int io61_poll(int fd, short events) {
+    struct pollfd pfd = { fd, events, 0 };
+    while (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+// io61_default_bufsize(fd)
+//   Picks a cache size for `fd`. `IO61_BUFSIZE` in the environment overrides
+//   the choice for every file. Otherwise pipes get their capacity (so `-B`
+//   takes effect), sockets their kernel buffer size, and everything else
+//   its preferred block size, but at least 8192 bytes. Regular files stay
+//   small because nonsequential readers refill the whole cache on every
+//   seek.
+off_t io61_default_bufsize(int fd) {
+    static constexpr off_t min_bufsize = 4096;
+    static constexpr off_t max_bufsize = 16 << 20;
+    off_t sz = 8192;
+
+    struct stat s;
+    const char* env = getenv("IO61_BUFSIZE");
+    if (env && *env) {
+        sz = strtol(env, nullptr, 0);
+    } else if (fstat(fd, &s) == -1) {
+        // keep default
+    } else if (S_ISFIFO(s.st_mode)) {
+#ifdef F_GETPIPE_SZ
+        int psz = fcntl(fd, F_GETPIPE_SZ);
+        sz = psz > 0 ? psz : 65536;
+#else
+        sz = 65536;
+#endif
+    } else if (S_ISSOCK(s.st_mode)) {
+        int ssz = 0;
+        socklen_t len = sizeof(ssz);
+        if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ssz, &len) == 0 && ssz > 0) {
+            sz = ssz;
+        }
+    } else {
+        sz = std::max((off_t) s.st_blksize, sz);
+        // round up to a multiple of the preferred block size
+        if (s.st_blksize > 0 && sz % s.st_blksize != 0) {
+            sz += s.st_blksize - sz % s.st_blksize;
+        }
+    }
+    return std::min(std::max(sz, min_bufsize), max_bufsize);
+}
+
+
 // io61_fdopen(fd, mode)
 //    Returns a new io61_file for file descriptor `fd`. `mode` is either
 //    O_RDONLY for a read-only file or O_WRONLY for a write-only file.
@@ -54,11 +256,29 @@ io61_file* io61_fdopen(int fd, int mode) {
         read_caches[fd]->fd = fd;
         read_caches[fd]->mode = O_RDONLY;
         read_caches[fd]->filesize = io61_filesize(f);
+        read_caches[fd]->bufsize = io61_default_bufsize(fd);
+        read_caches[fd]->cbuf = new unsigned char[read_caches[fd]->bufsize];
+        const char* ra_env = getenv("IO61_READAHEAD");
+        if (ra_env && *ra_env && strcmp(ra_env, "0") != 0) {
+            io61_set_readahead(f, 1);
+        }
     } else {
         write_caches[fd] = new io61_fcache;
         write_caches[fd]->fd = fd;
         write_caches[fd]->mode = O_WRONLY;
         write_caches[fd]->filesize = io61_filesize(f);
+        write_caches[fd]->bufsize = io61_default_bufsize(fd);
+        write_caches[fd]->cbuf = new unsigned char[write_caches[fd]->bufsize];
+    }
+    const char* stats_env = getenv("IO61_STATS");
+    io61_stats_on = stats_env && *stats_env && strcmp(stats_env, "0") != 0;
+    const char* uring_env = getenv("IO61_URING");
+    if (uring_env && *uring_env && strcmp(uring_env, "0") != 0) {
+        io61_set_uring(f, 1);
+    }
+    const char* direct_env = getenv("IO61_DIRECT");
+    if (direct_env && *direct_env && strcmp(direct_env, "0") != 0) {
+        io61_set_direct(f, 1);
     }
     return f;
 }
@@ -73,9 +293,18 @@ int io61_close(io61_file* f) {
         if (write_caches[fd]->tag != write_caches[fd]->pos_tag) {
             io61_flush(f);
         }
+        io61_set_uring(f, 0);
+        if (io61_stats_on) {
+            io61_print_stats(write_caches[fd]);
+        }
         delete write_caches[fd];
         write_caches.erase(fd);
     } else {
+        io61_set_readahead(f, 0);
+        io61_set_uring(f, 0);
+        if (io61_stats_on) {
+            io61_print_stats(read_caches[fd]);
+        }
         delete read_caches[fd];
         read_caches.erase(fd);
     }
@@ -84,6 +313,664 @@ int io61_close(io61_file* f) {
     return r;
 }
 
+// io61_set_bufsize(f, sz)
+//    Changes the cache size of `f` to `sz` bytes. If `sz` is 0, picks a
+//    default based on the file's type (see `io61_default_bufsize`). Cached
+//    data written to `f` is flushed first; unread data cached for reading
+//    is kept. Returns 0 on success and -1 on error.
+
+int io61_set_bufsize(io61_file* f, size_t sz) {
+    io61_fcache* cache;
+    bool readahead = false;
+    if (f->mode == O_WRONLY) {
+        if (io61_flush(f) == -1) {
+            return -1;
+        }
+        cache = write_caches[f->fd];
+    } else {
+        cache = read_caches[f->fd];
+        // Read-ahead buffers must match the cache size; restart it below
+        readahead = cache->ra != nullptr;
+        if (readahead && io61_set_readahead(f, 0) == -1) {
+            return -1;
+        }
+    }
+    // So must io_uring spare buffers
+    if (cache->u.enabled) {
+        if (io61_uring_settle(cache) == -1) {
+            return -1;
+        }
+        delete[] cache->u.buf;
+        cache->u.buf = nullptr;
+    }
+    if (sz == 0) {
+        sz = io61_default_bufsize(f->fd);
+    }
+
+    // Keep unread data at the start of the new buffer
+    size_t nunread = cache->end_tag - cache->pos_tag;
+    sz = std::max(sz, nunread);
+    unsigned char* cbuf;
+    if (cache->pooled) {
+        sz = (sz + io61_direct_align - 1) & ~(io61_direct_align - 1);
+        cbuf = io61_pool_get(sz);
+    } else {
+        cbuf = new unsigned char[sz];
+    }
+    memcpy(cbuf, &cache->cbuf[cache->pos_tag - cache->tag], nunread);
+    if (cache->pooled) {
+        io61_pool_put(cache->cbuf, cache->bufsize);
+    } else {
+        delete[] cache->cbuf;
+    }
+    cache->cbuf = cbuf;
+    cache->bufsize = sz;
+    cache->tag = cache->pos_tag;
+    if (readahead) {
+        return io61_set_readahead(f, 1);
+    }
+    return 0;
+}
+
+
+// io61_readahead_thread(cache)
+//   Body of the read-ahead thread: performs each requested read into the
+//   back buffer.
+static void io61_readahead_thread(io61_fcache* cache) {
+    io61_readahead* ra = cache->ra;
+    std::unique_lock guard(ra->m);
+    while (true) {
+        ra->cv.wait(guard, [&] () { return ra->pending || ra->stop; });
+        if (ra->stop) {
+            break;
+        }
+
+        // Read without holding the lock so the caller can keep consuming
+        size_t bufsize = ra->bufsize;
+        guard.unlock();
+        ssize_t nr;
+        do {
+            nr = read(cache->fd, ra->buf, bufsize);
+        } while (nr == -1 && errno == EINTR);
+        int err = errno;
+        guard.lock();
+
+        ra->nr = nr;
+        ra->err = err;
+        ra->pending = false;
+        ra->ready = true;
+        ra->cv.notify_all();
+    }
+}
+
+// io61_readahead_request(ra, bufsize)
+//   Asks the read-ahead thread to read the next `bufsize` bytes.
+//   Requires `ra->m` to be held and no read outstanding.
+static void io61_readahead_request(io61_readahead* ra, size_t bufsize) {
+    assert(!ra->pending && !ra->ready);
+    ra->bufsize = bufsize;
+    ra->pending = true;
+    ra->cv.notify_all();
+}
+
+// io61_readahead_quiesce(ra)
+//   Waits for an outstanding read-ahead to finish. Returns with `ra->m`
+//   held by `guard`.
+static void io61_readahead_quiesce(io61_readahead* ra, std::unique_lock<std::mutex>& guard) {
+    ra->cv.wait(guard, [&] () { return !ra->pending; });
+}
+
+// io61_readahead_take(cache)
+//   Swaps the next read-ahead buffer into `cache->cbuf`, waiting for it if
+//   necessary, and starts reading the one after. Returns the number of
+//   bytes now in `cache->cbuf`, 0 at end of file, or -1 on error.
+static ssize_t io61_readahead_take(io61_fcache* cache) {
+    io61_readahead* ra = cache->ra;
+    std::unique_lock guard(ra->m);
+    if (!ra->pending && !ra->ready) {
+        io61_readahead_request(ra, cache->bufsize);
+    }
+    ra->cv.wait(guard, [&] () { return ra->ready; });
+
+    std::swap(cache->cbuf, ra->buf);
+    ssize_t nr = ra->nr;
+    ra->ready = false;
+    if (nr > 0) {
+        io61_readahead_request(ra, cache->bufsize);
+    } else if (nr == -1) {
+        errno = ra->err;
+    }
+    return nr;
+}
+
+// io61_readahead_discard(cache)
+//   Waits for any outstanding read-ahead and drops its data. The file
+//   position is then unknown, so callers must seek.
+static void io61_readahead_discard(io61_fcache* cache) {
+    io61_readahead* ra = cache->ra;
+    std::unique_lock guard(ra->m);
+    io61_readahead_quiesce(ra, guard);
+    ra->ready = false;
+}
+
+
+// io61_set_readahead(f, enable)
+//    Turns background read-ahead on or off for the read-only file `f`.
+//    With read-ahead on, a helper thread reads the next cache-sized block
+//    while the caller consumes the current one, so I/O latency overlaps
+//    with the caller's work. Turning it off keeps data that was already
+//    read ahead whenever it can be stored in the cache. `IO61_READAHEAD=1`
+//    in the environment turns read-ahead on for every read-only file.
+//    Read-ahead can't be combined with O_DIRECT or io_uring. Returns 0 on
+//    success and -1 on error.
+
+int io61_set_readahead(io61_file* f, int enable) {
+    if (f->mode != O_RDONLY) {
+        return enable ? -1 : 0;
+    }
+    io61_fcache* cache = read_caches[f->fd];
+
+    if (enable && !cache->ra) {
+        if (cache->direct || cache->u.enabled) {
+            errno = EINVAL;
+            return -1;
+        }
+        cache->ra = new io61_readahead;
+        cache->ra->buf = new unsigned char[cache->bufsize];
+        cache->ra->th = std::thread(io61_readahead_thread, cache);
+    } else if (!enable && cache->ra) {
+        io61_readahead* ra = cache->ra;
+        {
+            std::unique_lock guard(ra->m);
+            io61_readahead_quiesce(ra, guard);
+            ra->stop = true;
+            ra->cv.notify_all();
+        }
+        ra->th.join();
+
+        // Keep read-ahead data that directly follows an empty cache
+        int r = 0;
+        if (ra->ready && ra->nr > 0 && cache->pos_tag == cache->end_tag) {
+            std::swap(cache->cbuf, ra->buf);
+            cache->tag = cache->pos_tag = cache->end_tag;
+            cache->end_tag += ra->nr;
+        } else if (ra->ready && ra->nr > 0) {
+            // The file position is past the cache; move it back
+            r = lseek(cache->fd, cache->end_tag, SEEK_SET) == -1 ? -1 : 0;
+            ++cache->st.nseeks;
+        }
+        delete ra;
+        cache->ra = nullptr;
+        return r;
+    }
+    return 0;
+}
+
+// IO_URING BACKEND
+//    All io61 files that opt in share one io_uring. Fills and flushes are
+//    queued on the ring but not submitted until some file must wait for a
+//    result, so one `io_uring_enter` carries the work of every file that
+//    touched the ring since the last one, and all available completions
+//    are reaped together.
+
+// io61_uring
+//    The shared ring.
+struct io61_uring {
+    int fd = -1;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+};
+
+static io61_uring uring;
+static int uring_state = 0;                     // 0 untried, 1 ready, -1 unavailable
+
+// io61_uring_init()
+//   Sets up the shared ring on first use. Returns false if io_uring is
+//   unavailable, for instance because the kernel is too old or it is
+//   disabled by policy.
+static bool io61_uring_init() {
+    if (uring_state != 0) {
+        return uring_state > 0;
+    }
+    uring_state = -1;
+
+    io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, 64, &p);
+    if (fd < 0) {
+        return false;
+    }
+    // Offset -1 (use and advance the file position) is needed for pipes
+    // and for mixing ring operations with ordinary system calls
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return false;
+    }
+
+    size_t sqsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    size_t sqesz = p.sq_entries * sizeof(io_uring_sqe);
+    void* sq = mmap(nullptr, sqsz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* cq = mmap(nullptr, cqsz, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(nullptr, sqesz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    unsigned char* sqp = (unsigned char*) sq;
+    unsigned char* cqp = (unsigned char*) cq;
+    uring.fd = fd;
+    uring.entries = p.sq_entries;
+    uring.sq_head = (unsigned*) (sqp + p.sq_off.head);
+    uring.sq_tail = (unsigned*) (sqp + p.sq_off.tail);
+    uring.sq_mask = (unsigned*) (sqp + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned*) (sqp + p.sq_off.array);
+    uring.sqes = (io_uring_sqe*) sqes;
+    uring.cq_head = (unsigned*) (cqp + p.cq_off.head);
+    uring.cq_tail = (unsigned*) (cqp + p.cq_off.tail);
+    uring.cq_mask = (unsigned*) (cqp + p.cq_off.ring_mask);
+    uring.cqes = (io_uring_cqe*) (cqp + p.cq_off.cqes);
+    uring_state = 1;
+    return true;
+}
+
+// io61_uring_enter(min_complete)
+//   Submits every queued operation and waits for at least `min_complete`
+//   completions. Returns 0 on success and -1 on error.
+static int io61_uring_enter(unsigned min_complete) {
+    while (true) {
+        unsigned nqueued = *uring.sq_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE);
+        unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+        int r = syscall(__NR_io_uring_enter, uring.fd, nqueued, min_complete,
+                        flags, nullptr, 0);
+        if (r >= 0) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// io61_uring_queue(cache, opcode, buf, len)
+//   Queues an `opcode` (read or write) operation for `cache` at the file's
+//   current position. The operation is not submitted yet. Returns 0 on
+//   success and -1 if the ring was full and could not be submitted.
+static int io61_uring_queue(io61_fcache* cache, int opcode,
+                            unsigned char* buf, size_t len) {
+    unsigned tail = *uring.sq_tail;
+    if (tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE) == uring.entries) {
+        // Ring is full: submit to make room
+        if (io61_uring_enter(0) == -1) {
+            return -1;
+        }
+    }
+    unsigned idx = tail & *uring.sq_mask;
+    io_uring_sqe* sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = cache->fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = (__u64) -1;
+    sqe->user_data = (uintptr_t) cache;
+    uring.sq_array[idx] = idx;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// io61_uring_complete(cache, res)
+//   Records the result of `cache`'s in-flight operation. Short writes are
+//   finished with ordinary `write` calls.
+static void io61_uring_complete(io61_fcache* cache, int res) {
+    io61_uring_slot& u = cache->u;
+    if (cache->mode == O_WRONLY) {
+        if (res == -EINTR || res == -EAGAIN) {
+            res = 0;
+        }
+        size_t nw = std::max(res, 0);
+        while (res >= 0 && nw < u.len) {
+            ssize_t r = write(cache->fd, &u.buf[nw], u.len - nw);
+            if (r >= 0) {
+                nw += r;
+            } else if (errno == EAGAIN && io61_poll(cache->fd, POLLOUT) == 0) {
+                continue;
+            } else if (errno != EINTR) {
+                res = -errno;
+            }
+        }
+        if (res < 0) {
+            u.err = -res;
+        }
+        u.inflight = false;
+    } else {
+        u.res = res;
+        u.done = true;
+    }
+}
+
+// io61_uring_reap()
+//   Handles every available completion without blocking.
+static void io61_uring_reap() {
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        io_uring_cqe* cqe = &uring.cqes[head & *uring.cq_mask];
+        io61_uring_complete((io61_fcache*) (uintptr_t) cqe->user_data, cqe->res);
+        ++head;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// io61_uring_wait(cache)
+//   Waits until `cache` has no unfinished operation, submitting all queued
+//   operations (for every file) on the way. Returns 0 on success and -1
+//   if the ring failed; the operation then stays unfinished.
+static int io61_uring_wait(io61_fcache* cache) {
+    io61_uring_reap();
+    while (cache->u.inflight && !cache->u.done) {
+        if (io61_uring_enter(1) == -1) {
+            return -1;
+        }
+        io61_uring_reap();
+    }
+    return 0;
+}
+
+// io61_uring_queue_read(cache)
+//   Queues a read of the data following `cache` into its spare buffer.
+//   Returns 0 on success and -1 on error.
+static int io61_uring_queue_read(io61_fcache* cache) {
+    io61_uring_slot& u = cache->u;
+    assert(!u.inflight);
+    if (!u.buf) {
+        u.buf = new unsigned char[cache->bufsize];
+    }
+    u.len = cache->bufsize;
+    if (io61_uring_queue(cache, IORING_OP_READ, u.buf, u.len) == -1) {
+        return -1;
+    }
+    u.inflight = true;
+    u.done = false;
+    return 0;
+}
+
+// io61_uring_fill(cache)
+//   io_uring version of `io61_fill`'s read: swaps the data following the
+//   (empty) cache into `cache->cbuf`, then queues the next read if two
+//   full fills in a row suggest the file is read sequentially. Returns
+//   the number of bytes filled, 0 at end of file, or -1 on error.
+static ssize_t io61_uring_fill(io61_fcache* cache) {
+    io61_uring_slot& u = cache->u;
+    if ((!u.inflight && io61_uring_queue_read(cache) == -1)
+        || io61_uring_wait(cache) == -1) {
+        return -1;
+    }
+
+    std::swap(cache->cbuf, u.buf);
+    ssize_t nr = u.res;
+    u.inflight = u.done = false;
+    bool sequential = u.streaming;
+    u.streaming = nr == cache->bufsize;
+    if (sequential && u.streaming && io61_uring_queue_read(cache) == -1) {
+        // Not fatal: the next fill queues its own read
+        u.streaming = false;
+    }
+    if (nr < 0) {
+        errno = -nr;
+        nr = -1;
+    }
+    return nr;
+}
+
+// io61_uring_flush(cache, wait)
+//   io_uring version of a write cache flush: hands the cached data to the
+//   ring and gives the cache a fresh buffer. If `wait` is true, waits for
+//   the write to finish. Returns 0 on success and -1 if this or an earlier
+//   asynchronous write failed.
+static int io61_uring_flush(io61_fcache* cache, bool wait) {
+    io61_uring_slot& u = cache->u;
+    double t0 = io61_now();
+    ++cache->st.nflushes;
+    // Writes to one file go out in order, one at a time
+    if (io61_uring_wait(cache) == -1) {
+        cache->st.blocked += io61_now() - t0;
+        return -1;
+    }
+
+    size_t n = cache->pos_tag - cache->tag;
+    if (n > 0 && !u.err) {
+        if (!u.buf) {
+            u.buf = new unsigned char[cache->bufsize];
+        }
+        if (io61_uring_queue(cache, IORING_OP_WRITE, cache->cbuf, n) == -1) {
+            // The data stays cached for a later flush
+            cache->st.blocked += io61_now() - t0;
+            return -1;
+        }
+        std::swap(cache->cbuf, u.buf);
+        u.len = n;
+        u.inflight = true;
+        ++cache->st.nwrites;
+        cache->st.bytes_written += n;
+        cache->tag = cache->pos_tag = cache->end_tag;
+    }
+    int r = wait ? io61_uring_wait(cache) : 0;
+    cache->st.blocked += io61_now() - t0;
+    if (r == -1) {
+        return -1;
+    }
+
+    if (u.err) {
+        errno = u.err;
+        u.err = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// io61_uring_settle(cache)
+//   Finishes `cache`'s in-flight operation so the file position matches
+//   the cache. Read-ahead data that directly follows an empty cache is
+//   kept; otherwise the file position is moved back. Since settling
+//   usually precedes a seek, read-ahead then restarts only after two more
+//   full fills. Returns 0 on success and -1 on error.
+static int io61_uring_settle(io61_fcache* cache) {
+    io61_uring_slot& u = cache->u;
+    if (io61_uring_wait(cache) == -1) {
+        return -1;
+    }
+    if (cache->mode == O_WRONLY) {
+        if (u.err) {
+            errno = u.err;
+            u.err = 0;
+            return -1;
+        }
+        return 0;
+    }
+
+    u.streaming = false;
+    if (u.inflight) {
+        u.inflight = u.done = false;
+        if (u.res > 0 && cache->pos_tag == cache->end_tag) {
+            std::swap(cache->cbuf, u.buf);
+            cache->tag = cache->pos_tag = cache->end_tag;
+            cache->end_tag += u.res;
+        } else if (u.res > 0) {
+            ++cache->st.nseeks;
+            if (lseek(cache->fd, cache->end_tag, SEEK_SET) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+// io61_set_uring(f, enable)
+//    Moves `f` onto or off the shared io_uring backend. On the ring, cache
+//    fills and flushes are batched with those of other io_uring files and
+//    overlap with the caller's work: sequential reads are read one cache
+//    ahead, and full write caches are written in the background.
+//    `IO61_URING=1` in the environment enables the backend for every file.
+//    Returns 0 on success. Returns -1 if io_uring is unavailable, or if
+//    `f` uses O_DIRECT or read-ahead, in which case `f` keeps using
+//    ordinary system calls.
+
+int io61_set_uring(io61_file* f, int enable) {
+    io61_fcache* cache = f->mode == O_RDONLY ? read_caches[f->fd] : write_caches[f->fd];
+    if (enable && !cache->u.enabled) {
+        if (cache->direct || cache->ra) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (!io61_uring_init()) {
+            errno = ENOSYS;
+            return -1;
+        }
+        cache->u.enabled = true;
+    } else if (!enable && cache->u.enabled) {
+        int r = io61_uring_settle(cache);
+        cache->u.enabled = false;
+        delete[] cache->u.buf;
+        cache->u.buf = nullptr;
+        return r;
+    }
+    return 0;
+}
+
+
+// io61_set_odirect(cache, on)
+//   Sets or clears O_DIRECT on `cache->fd`. Returns 0 on success and -1
+//   on error.
+static int io61_set_odirect(io61_fcache* cache, bool on) {
+    if (cache->odirect == on) {
+        return 0;
+    }
+    int fl = fcntl(cache->fd, F_GETFL);
+    if (fl == -1
+        || fcntl(cache->fd, F_SETFL, on ? fl | O_DIRECT : fl & ~O_DIRECT) == -1) {
+        return -1;
+    }
+    cache->odirect = on;
+    return 0;
+}
+
+// io61_direct_fallback(cache)
+//   Returns `cache` to buffered I/O after the file system accepted
+//   O_DIRECT but rejected a transfer with EINVAL. The cache keeps its
+//   pooled buffer. Returns true if the transfer should be retried.
+static bool io61_direct_fallback(io61_fcache* cache) {
+    if (errno != EINVAL || !cache->odirect) {
+        return false;
+    }
+    cache->direct = false;
+    return io61_set_odirect(cache, false) == 0;
+}
+
+
+// io61_set_direct(f, enable)
+//    Turns direct I/O on or off for `f`. Direct I/O sets O_DIRECT, so
+//    reads and writes move between the device and a page-aligned cache
+//    buffer without passing through (and evicting) the kernel's page
+//    cache, which suits very large streaming copies. Every cache miss
+//    then waits for the device, so the cache grows to at least 1MB and
+//    nonsequential readers get much slower. Cache sizes are rounded up to
+//    whole 4096-byte blocks and fills start on a block boundary; the
+//    unaligned head and tail of a flush go out as ordinary buffered
+//    writes. `IO61_DIRECT=1` in the environment turns direct I/O on for
+//    every regular file.
+//
+//    Returns 0 on success. Returns -1 if `f` is not a regular file, uses
+//    read-ahead or io_uring, or sits on a file system without O_DIRECT
+//    support; `f` then stays buffered. A file system that accepts
+//    O_DIRECT but later rejects a transfer also falls back to buffered I/O.
+
+int io61_set_direct(io61_file* f, int enable) {
+    io61_fcache* cache = f->mode == O_RDONLY ? read_caches[f->fd] : write_caches[f->fd];
+    if (enable && !cache->direct) {
+        struct stat s;
+        if (cache->ra || cache->u.enabled
+            || fstat(cache->fd, &s) == -1 || !S_ISREG(s.st_mode)) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (f->mode == O_WRONLY && io61_flush(f) == -1) {
+            return -1;
+        }
+        if (io61_set_odirect(cache, true) == -1) {
+            return -1;
+        }
+
+        // Move cached data into a large aligned buffer
+        if (!cache->pooled) {
+            size_t sz = std::max((size_t) cache->bufsize, io61_direct_bufsize);
+            sz = (sz + io61_direct_align - 1) & ~(io61_direct_align - 1);
+            unsigned char* cbuf = io61_pool_get(sz);
+            size_t nunread = cache->end_tag - cache->pos_tag;
+            memcpy(cbuf, &cache->cbuf[cache->pos_tag - cache->tag], nunread);
+            delete[] cache->cbuf;
+            cache->cbuf = cbuf;
+            cache->bufsize = sz;
+            cache->tag = cache->pos_tag;
+            cache->pooled = true;
+        }
+        cache->direct = true;
+    } else if (!enable && cache->direct) {
+        if (f->mode == O_WRONLY && io61_flush(f) == -1) {
+            return -1;
+        }
+        cache->direct = false;
+        return io61_set_odirect(cache, false);
+    }
+    return 0;
+}
+
+
+// io61_direct_fill(cache)
+//   Reads a cacheful for an empty direct-I/O read cache. O_DIRECT reads
+//   must start on a block boundary, so when `end_tag` is unaligned (after
+//   a seek or a short read) the read starts at the preceding boundary and
+//   the cache begins before `pos_tag`. Returns the number of bytes cached
+//   past `pos_tag`, 0 at end of file, or -1 on error.
+static ssize_t io61_direct_fill(io61_fcache* cache) {
+    // O_DIRECT is off after `io61_transfer`
+    io61_set_odirect(cache, true);
+
+    off_t start = cache->end_tag & ~(off_t) (io61_direct_align - 1);
+    size_t skip = cache->end_tag - start;
+    if (skip != 0) {
+        ++cache->st.nseeks;
+        if (lseek(cache->fd, start, SEEK_SET) == -1) {
+            return -1;
+        }
+    }
+
+    ssize_t nr;
+    do {
+        nr = read(cache->fd, cache->cbuf, cache->bufsize);
+    } while (nr == -1 && (errno == EINTR || io61_direct_fallback(cache)));
+    if (nr == -1) {
+        return -1;
+    } else if ((size_t) nr <= skip) {
+        return 0;
+    }
+    cache->tag = start;
+    return nr - skip;
+}
+
+
 // io61_fill(cache)
 //   Fills a read cache with chars
 //   Returns number of chars filled
@@ -95,10 +982,24 @@ int io61_fill(io61_fcache* cache) {
     cache->tag = cache->pos_tag = cache->end_tag;
 
     // Fill cache
-    ssize_t nfilled = read(cache->fd, cache->cbuf, cache->bufsize);
+    double t0 = io61_now();
+    ssize_t nfilled;
+    if (cache->ra) {
+        nfilled = io61_readahead_take(cache);
+    } else if (cache->u.enabled) {
+        nfilled = io61_uring_fill(cache);
+    } else if (cache->direct) {
+        nfilled = io61_direct_fill(cache);
+    } else {
+        nfilled = read(cache->fd, cache->cbuf, cache->bufsize);
+    }
+    ++cache->st.nreads;
+    cache->st.bytes_read += std::max(nfilled, (ssize_t) 0);
+    cache->st.blocked += io61_now() - t0;
 
-    // Update end tag accordingly
-    cache->end_tag = cache->tag + nfilled;
+    // Update end tag accordingly; after an error (such as EAGAIN on a
+    // nonblocking file) the cache stays empty
+    cache->end_tag = cache->pos_tag + std::max(nfilled, (ssize_t) 0);
 
     // Check invariant
     assert(cache->end_tag - cache->pos_tag <= cache->bufsize);
@@ -106,6 +1007,39 @@ int io61_fill(io61_fcache* cache) {
 }
 
 
+// io61_read_bypass(cache, buf, sz)
+//   Reads directly into `buf` with one `readv`, refilling the (empty) cache
+//   with whatever follows `buf` in the same system call. Returns the number
+//   of bytes stored in `buf`, 0 on end of file, or -1 on error.
+ssize_t io61_read_bypass(io61_fcache* cache, unsigned char* buf, size_t sz) {
+    // Check invariant
+    assert(cache->pos_tag == cache->end_tag);
+
+    struct iovec iov[2] = {
+        { buf, sz },
+        { cache->cbuf, (size_t) cache->bufsize }
+    };
+    double t0 = io61_now();
+    ssize_t nr = readv(cache->fd, iov, 2);
+    ++cache->st.nreads;
+    cache->st.blocked += io61_now() - t0;
+    if (nr <= 0) {
+        return nr;
+    }
+    cache->st.bytes_read += nr;
+
+    // Bytes beyond `sz` landed in the cache
+    size_t ncaller = std::min((size_t) nr, sz);
+    off_t start = cache->end_tag;
+    cache->tag = cache->pos_tag = start + ncaller;
+    cache->end_tag = start + nr;
+
+    // Check invariant
+    assert(cache->end_tag - cache->pos_tag <= cache->bufsize);
+    return ncaller;
+}
+
+
 // io61_readc(f)
 //    Reads a single (unsigned) byte from `f` and returns it. Returns EOF,
 //    which equals -1, on end of file or error.
@@ -119,11 +1053,16 @@ int io61_readc(io61_file* f) {
 
     // If empty, refill read cache
     if (read_cache->pos_tag == read_cache->end_tag) {
+        ++read_cache->st.misses;
         int nfilled =  io61_fill(read_cache);
-        if (nfilled == 0) {
-            errno = 0;  // clear `errno` to indicate EOF
+        if (nfilled <= 0) {
+            if (nfilled == 0) {
+                errno = 0;  // clear `errno` to indicate EOF
+            }
             return -1;
         }
+    } else {
+        ++read_cache->st.hits;
     }
 
     // If cache is associated with dev zero
@@ -154,40 +1093,107 @@ int io61_readc(io61_file* f) {
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
     // Acquire associated cache
     io61_fcache* read_cache = read_caches[f->fd];
+    unsigned long nreads0 = read_cache->st.nreads;
 
     size_t nread = 0;
-    off_t buffer_offset = 0;
     while (nread != sz) {
+        // Large requests bypass the cache once it is drained (unless
+        // read-ahead data is on its way, or direct I/O needs the aligned
+        // cache buffer)
+        if (read_cache->pos_tag == read_cache->end_tag
+            && !read_cache->ra
+            && !read_cache->u.inflight
+            && !read_cache->direct
+            && sz - nread >= (size_t) read_cache->bufsize) {
+            ssize_t nbypassed = io61_read_bypass(read_cache, &buf[nread], sz - nread);
+            if (nbypassed <= 0) {
+                if (nbypassed == 0) {
+                    errno = 0;  // clear `errno` to indicate EOF
+                }
+                break;
+            }
+            nread += nbypassed;
+            continue;
+        }
+
         // Fill cache as needed
         if (read_cache->pos_tag == read_cache->end_tag) {
             int nfilled = io61_fill(read_cache);
-            if (nfilled == 0) {
+            if (nfilled <= 0) {
+                if (nfilled == 0) {
+                    errno = 0;  // clear `errno` to indicate EOF
+                }
                 break;
             }
         }
 
-        // Caclulate how many bytes are in cache
-        size_t bytes_in_cache = read_cache->end_tag - read_cache->tag;
+        // Determine how many bytes we read from the cache in this pass
+        size_t bytes_unread = read_cache->end_tag - read_cache->pos_tag;
+        size_t bytes_to_read = std::min(bytes_unread, sz - nread);
+
+        // Read from cache
+        memcpy(&buf[nread], &read_cache->cbuf[read_cache->pos_tag - read_cache->tag], bytes_to_read);
+        read_cache->pos_tag += bytes_to_read;
+        nread += bytes_to_read;
+    }
+    ++(read_cache->st.nreads == nreads0 ? read_cache->st.hits : read_cache->st.misses);
 
-        // Caclulate how many bytes are readable in total
-        size_t total_bytes_readable = std::min(bytes_in_cache, sz - nread);
+    if (nread != 0 || sz == 0 || errno == 0) {
+        return nread;
+    } else {
+        return -1;
+    }
+}
 
-        // Calculate bytes currently unread in our cache
-        size_t bytes_unread = read_cache->end_tag - read_cache->pos_tag;
 
-        // Use above values to determine the quantity of bytes we read in this pass
-        size_t bytes_to_read = std::min(total_bytes_readable, bytes_unread);
+// io61_readline(f, buf, sz)
+//    Reads up to `sz` bytes from `f` into `buf`, stopping after the first
+//    newline. Returns the number of bytes read (including the newline),
+//    0 at end of file, or -1 on error. Lines longer than `sz`, or
+//    interrupted by end of file, come back in pieces.
+//
+//    Each pass scans the cached data with `memchr`, which the C library
+//    vectorizes, and copies everything up to the newline at once.
 
-        // Read from cache
-        memcpy(&buf[buffer_offset], &read_cache->cbuf[read_cache->pos_tag - read_cache->tag], bytes_to_read);
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    // Acquire associated cache
+    io61_fcache* read_cache = read_caches[f->fd];
+
+    // /dev/zero has no newlines
+    if (read_cache->is_dev_zero) {
+        memset(buf, 0, sz);
+        return sz;
+    }
+
+    unsigned long nreads0 = read_cache->st.nreads;
+    size_t nread = 0;
+    bool eol = false;
+    while (nread != sz && !eol) {
+        // Fill cache as needed
+        if (read_cache->pos_tag == read_cache->end_tag) {
+            int nfilled = io61_fill(read_cache);
+            if (nfilled <= 0) {
+                if (nfilled == 0) {
+                    errno = 0;  // clear `errno` to indicate EOF
+                }
+                break;
+            }
+        }
 
-        // Update offset as needed
-        if (bytes_to_read < sz) {
-            buffer_offset = bytes_to_read;
+        // Copy up to the newline, or everything cached if there is none;
+        // a line that crosses the cache boundary continues on the next pass
+        const unsigned char* p = &read_cache->cbuf[read_cache->pos_tag - read_cache->tag];
+        size_t bytes_to_read = std::min((size_t) (read_cache->end_tag - read_cache->pos_tag),
+                                        sz - nread);
+        if (const void* nl = memchr(p, '\n', bytes_to_read)) {
+            bytes_to_read = (const unsigned char*) nl - p + 1;
+            eol = true;
         }
+        memcpy(&buf[nread], p, bytes_to_read);
         read_cache->pos_tag += bytes_to_read;
         nread += bytes_to_read;
     }
+    ++(read_cache->st.nreads == nreads0 ? read_cache->st.hits : read_cache->st.misses);
 
     if (nread != 0 || sz == 0 || errno == 0) {
         return nread;
@@ -197,6 +1203,60 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
 }
 
 
+// io61_peek(f, ptr)
+//    Sets `*ptr` to the bytes cached for reading at `f`'s position,
+//    filling the cache first if it is empty, and returns how many there
+//    are. Returns 0 at end of file and -1 on error. The bytes stay valid
+//    until the next other operation on `f`; `io61_consume` moves past the
+//    ones the caller used. Tokenizers can scan this window in place
+//    instead of calling `io61_readc` for every byte.
+
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr) {
+    // Acquire associated cache
+    io61_fcache* read_cache = read_caches[f->fd];
+
+    // /dev/zero: present a cache full of zeros
+    if (read_cache->is_dev_zero) {
+        memset(read_cache->cbuf, 0, read_cache->bufsize);
+        read_cache->tag = read_cache->pos_tag;
+        read_cache->end_tag = read_cache->tag + read_cache->bufsize;
+        *ptr = read_cache->cbuf;
+        return read_cache->bufsize;
+    }
+
+    // If empty, refill read cache
+    if (read_cache->pos_tag == read_cache->end_tag) {
+        ++read_cache->st.misses;
+        int nfilled = io61_fill(read_cache);
+        if (nfilled <= 0) {
+            if (nfilled == 0) {
+                errno = 0;  // clear `errno` to indicate EOF
+            }
+            return nfilled;
+        }
+    } else {
+        ++read_cache->st.hits;
+    }
+
+    *ptr = &read_cache->cbuf[read_cache->pos_tag - read_cache->tag];
+    return read_cache->end_tag - read_cache->pos_tag;
+}
+
+
+// io61_consume(f, n)
+//    Advances `f`'s read position past the first `n` bytes of the window
+//    returned by the last `io61_peek`.
+
+void io61_consume(io61_file* f, size_t n) {
+    io61_fcache* read_cache = read_caches[f->fd];
+    assert(n <= (size_t) (read_cache->end_tag - read_cache->pos_tag));
+    read_cache->pos_tag += n;
+}
+
+
+int io61_write_bypass(io61_fcache* cache, const unsigned char* buf, size_t sz);
+int io61_flush_full(io61_fcache* cache);
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success and
 //    -1 on error.
@@ -210,9 +1270,12 @@ int io61_writec(io61_file* f, int ch) {
 
     // If cache is full, flush before copying new char to it
     if (write_cache->pos_tag - write_cache->tag == write_cache->bufsize) {
-         if (io61_flush(f) == -1) {
+        ++write_cache->st.misses;
+         if (io61_flush_full(write_cache) == -1) {
             return -1;
         }
+    } else {
+        ++write_cache->st.hits;
     }
 
     // Copy char to write cache
@@ -239,10 +1302,20 @@ int io61_writec(io61_file* f, int ch) {
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
     // Acquire associated write cache
     io61_fcache* write_cache = write_caches[f->fd];
+    unsigned long nwrites0 = write_cache->st.nwrites;
 
     size_t nwritten = 0;
-    off_t buffer_offset = 0;
     while (nwritten != sz) {
+        // Large requests go out in one `writev` together with the cache
+        // (direct I/O can't write from the caller's unaligned buffer)
+        if (sz - nwritten >= (size_t) write_cache->bufsize && !write_cache->direct) {
+            if (io61_write_bypass(write_cache, &buf[nwritten], sz - nwritten) == -1) {
+                return -1;
+            }
+            nwritten = sz;
+            break;
+        }
+
         // Determine how much space is left in write cache
         size_t bytes_writable = write_cache->tag + write_cache->bufsize - write_cache->pos_tag;
 
@@ -250,10 +1323,7 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
         size_t bytes_to_write = std::min(bytes_writable, sz - nwritten);
 
         // Copy from buffer to write cache
-        memcpy(&write_cache->cbuf[write_cache->pos_tag - write_cache->tag], &buf[buffer_offset], bytes_to_write);
-        if (bytes_to_write < sz) {
-            buffer_offset = bytes_to_write;
-        }
+        memcpy(&write_cache->cbuf[write_cache->pos_tag - write_cache->tag], &buf[nwritten], bytes_to_write);
 
         // Increment cache file positions accordingly
         write_cache->pos_tag += bytes_to_write;
@@ -262,11 +1332,12 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 
         // Flush cache if full
         if (write_cache->pos_tag - write_cache->tag == write_cache->bufsize) {
-            if (io61_flush(f) == -1) {
+            if (io61_flush_full(write_cache) == -1) {
                 return -1;
             }
         }
     }
+    ++(write_cache->st.nwrites == nwrites0 ? write_cache->st.hits : write_cache->st.misses);
 
     if (nwritten != 0 || sz == 0) {
         return nwritten;
@@ -276,6 +1347,175 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 }
 
 
+// io61_reserve(f, ptr)
+//    Sets `*ptr` to the free space in `f`'s write cache, flushing the
+//    cache first if it is full, and returns its size. The caller fills
+//    a prefix of the space and hands it to `io61_commit`. Returns -1 if
+//    the flush fails.
+
+ssize_t io61_reserve(io61_file* f, unsigned char** ptr) {
+    // Acquire associated write cache
+    io61_fcache* write_cache = write_caches[f->fd];
+
+    // Check invariant
+    assert(write_cache->pos_tag == write_cache->end_tag);
+
+    // If cache is full, flush before handing out space
+    if (write_cache->pos_tag - write_cache->tag == write_cache->bufsize) {
+        ++write_cache->st.misses;
+        if (io61_flush_full(write_cache) == -1) {
+            return -1;
+        }
+    } else {
+        ++write_cache->st.hits;
+    }
+
+    *ptr = &write_cache->cbuf[write_cache->pos_tag - write_cache->tag];
+    return write_cache->tag + write_cache->bufsize - write_cache->pos_tag;
+}
+
+
+// io61_commit(f, n)
+//    Appends the first `n` bytes of the space returned by the last
+//    `io61_reserve` to `f`. Returns 0; a full cache is flushed by the
+//    next write.
+
+int io61_commit(io61_file* f, size_t n) {
+    io61_fcache* write_cache = write_caches[f->fd];
+    assert(n <= (size_t) (write_cache->tag + write_cache->bufsize - write_cache->pos_tag));
+    write_cache->pos_tag += n;
+    write_cache->end_tag += n;
+    return 0;
+}
+
+
+// io61_write_bypass(cache, buf, sz)
+//   Writes the cached data followed by all of `buf` with `writev`, leaving
+//   the cache empty. Returns 0 on success and -1 on error. On error, the
+//   cached data that was written is dropped and the rest moves to the
+//   front of the cache, as in `io61_flush_range`.
+int io61_write_bypass(io61_fcache* cache, const unsigned char* buf, size_t sz) {
+    // Check invariant
+    assert(cache->pos_tag == cache->end_tag);
+
+    // Earlier asynchronous writes must land first
+    if (cache->u.enabled && io61_uring_settle(cache) == -1) {
+        return -1;
+    }
+
+    struct iovec iov[2] = {
+        { cache->cbuf, (size_t) (cache->pos_tag - cache->tag) },
+        { const_cast<unsigned char*>(buf), sz }
+    };
+    size_t head = iov[0].iov_len, n = 0;
+    double t0 = io61_now();
+    int iovi = 0;
+    while (iovi != 2) {
+        ssize_t nw = writev(cache->fd, &iov[iovi], 2 - iovi);
+        ++cache->st.nwrites;
+        if (nw == -1) {
+            if (errno == EINTR
+                || (errno == EAGAIN && io61_poll(cache->fd, POLLOUT) == 0)) {
+                continue;
+            }
+            cache->st.blocked += io61_now() - t0;
+            if (n < head) {
+                memmove(cache->cbuf, &cache->cbuf[n], head - n);
+                cache->tag += n;
+            } else {
+                cache->tag = cache->pos_tag = cache->end_tag =
+                    cache->end_tag + (n - head);
+            }
+            return -1;
+        }
+        cache->st.bytes_written += nw;
+        n += nw;
+
+        // Skip fully written vectors and trim a partially written one
+        while (iovi != 2 && (size_t) nw >= iov[iovi].iov_len) {
+            nw -= iov[iovi].iov_len;
+            ++iovi;
+        }
+        if (iovi != 2) {
+            iov[iovi].iov_base = (unsigned char*) iov[iovi].iov_base + nw;
+            iov[iovi].iov_len -= nw;
+        }
+    }
+
+    cache->st.blocked += io61_now() - t0;
+
+    // Mark cache empty
+    cache->tag = cache->pos_tag = cache->end_tag = cache->end_tag + sz;
+    return 0;
+}
+
+
+// io61_flush_range(cache, len, direct, wait)
+//   Writes the first `len` bytes of write cache `cache`, with O_DIRECT on
+//   if `direct` is true, and moves the data that remains to the front of
+//   the cache. Waits as in `io61_flush_some`. Returns the number of bytes
+//   written.
+static size_t io61_flush_range(io61_fcache* cache, size_t len, bool direct, bool wait) {
+    if (len == 0 || (cache->direct && io61_set_odirect(cache, direct) == -1)) {
+        return 0;
+    }
+    size_t n = 0;
+    while (n != len) {
+        ssize_t nw = write(cache->fd, &cache->cbuf[n], len - n);
+        ++cache->st.nwrites;
+        if (nw >= 0) {
+            n += nw;
+        } else if (errno == EINTR
+                   || (errno == EAGAIN && wait && io61_poll(cache->fd, POLLOUT) == 0)
+                   || (direct && io61_direct_fallback(cache))) {
+            continue;
+        } else {
+            break;
+        }
+    }
+
+    cache->st.bytes_written += n;
+    if (n != 0) {
+        memmove(cache->cbuf, &cache->cbuf[n], cache->pos_tag - cache->tag - n);
+        cache->tag += n;
+    }
+    return n;
+}
+
+// io61_flush_some(cache, wait)
+//   Writes the data in write cache `cache`. If `wait` is true, waits with
+//   `poll` whenever the file can't take more data and returns only once
+//   the cache is empty or an error occurs. Otherwise stops at EAGAIN.
+//   Unwritten data moves to the front of the cache. Returns the number of
+//   bytes written, or -1 if nothing could be written.
+static ssize_t io61_flush_some(io61_fcache* cache, bool wait) {
+    size_t len = cache->pos_tag - cache->tag;
+    size_t n;
+    double t0 = io61_now();
+    ++cache->st.nflushes;
+
+    if (cache->direct) {
+        // O_DIRECT writes whole blocks from the aligned cache buffer; an
+        // unaligned head or tail goes out as a buffered write
+        size_t head = std::min(len, (size_t) -cache->tag & (io61_direct_align - 1));
+        n = io61_flush_range(cache, head, false, wait);
+        if (n == head) {
+            size_t body = (len - n) & ~(io61_direct_align - 1);
+            size_t nbody = io61_flush_range(cache, body, true, wait);
+            n += nbody;
+            if (nbody == body) {
+                n += io61_flush_range(cache, len - n, false, wait);
+            }
+        }
+    } else {
+        n = io61_flush_range(cache, len, false, wait);
+    }
+
+    cache->st.blocked += io61_now() - t0;
+    return n != 0 || len == 0 ? (ssize_t) n : -1;
+}
+
+
 // io61_flush(f)
 //    Forces a write of any cached data written to `f`. Returns 0 on
 //    success. Returns -1 if an error is encountered before all cached
@@ -289,32 +1529,17 @@ int io61_flush(io61_file* f) {
     if (f->mode == O_WRONLY) {
         // Acquire associated cache
         cache = write_caches[f->fd];
+        if (cache->u.enabled) {
+            return io61_uring_flush(cache, true);
+        }
 
         // Check invariants.
         assert(cache->pos_tag - cache->tag <= cache->bufsize);
         assert(cache->pos_tag == cache->end_tag);
 
-        // Determine how many bytes to write
-        int bytes_to_write = cache->pos_tag - cache->tag;
-
-        // Write from cache to file
-        ssize_t nwritten = write(f->fd, &cache->cbuf, bytes_to_write);
-
-        // Check all bytes were written from cache
-        if (nwritten != bytes_to_write) {
-            if (errno == EINTR || errno == EAGAIN) {
-                nwritten = std::max((int) nwritten, 0);
-                int total_written = nwritten;
-                cache->tag += nwritten;
-                while (cache->tag != cache->end_tag) {
-                    nwritten = write(f->fd, &cache->cbuf[total_written], cache->pos_tag - cache->tag);
-                    nwritten = std::max((int) nwritten, 0);
-                    cache->tag += nwritten;
-                    total_written += nwritten;
-                }
-            } else {
-                return -1;
-            }
+        // Write from cache to file, waiting for the file as needed
+        if (io61_flush_some(cache, true) == -1 || cache->tag != cache->pos_tag) {
+            return -1;
         }
     } else {
         // Acquire associated cache
@@ -325,9 +1550,177 @@ int io61_flush(io61_file* f) {
     return 0;
 }
 
+// io61_try_flush(f)
+//    Writes as much of the data cached for `f` as the file accepts right
+//    now, like a nonblocking `write`. Returns the number of bytes written,
+//    which is 0 once nothing is cached. Returns -1 with `errno == EAGAIN`
+//    if data remains but the file can't take any: event loops wait for
+//    `io61_fileno(f)` to become writable and call again. Unwritten data
+//    stays cached. On io_uring, hands all cached data to the ring.
+
+ssize_t io61_try_flush(io61_file* f) {
+    if (f->mode != O_WRONLY) {
+        return 0;
+    }
+    io61_fcache* cache = write_caches[f->fd];
+    if (cache->u.enabled) {
+        ssize_t n = cache->pos_tag - cache->tag;
+        return io61_uring_flush(cache, false) == -1 ? -1 : n;
+    }
+    return io61_flush_some(cache, false);
+}
+
+
+// io61_flush_full(cache)
+//   Flushes a full write cache. On io_uring the write finishes in the
+//   background; otherwise this is `io61_flush`.
+int io61_flush_full(io61_fcache* cache) {
+    if (cache->u.enabled) {
+        return io61_uring_flush(cache, false);
+    }
+    io61_file f;
+    f.fd = cache->fd;
+    f.mode = O_WRONLY;
+    return io61_flush(&f);
+}
+
 int io61_seek_read(io61_fcache* cache, off_t pos);
 int io61_seek_write(io61_file* f, io61_fcache* cache, off_t pos);
 
+// io61_transfer_fd(infd, outfd, sz, rst, wst)
+//   Moves up to `sz` bytes from `infd` to `outfd` at their file positions.
+//   Tries `copy_file_range` (regular files), then `splice` (one end is a
+//   pipe), then `sendfile` (input can be mapped), moving on when the
+//   kernel reports that a call doesn't apply to these files (for
+//   instance, `copy_file_range` rejects `O_APPEND` outputs). If none
+//   does, copies through a small user-space buffer. Counts each kernel
+//   copy call in `wst.ntransfers`, and each fallback read and write in
+//   `rst.nreads` and `wst.nwrites`. Returns the number of bytes moved,
+//   which is short only at end of file, or -1 on error.
+static ssize_t io61_transfer_fd(int infd, int outfd, size_t sz,
+                                io61_stats& rst, io61_stats& wst) {
+    int method = 0;
+    size_t n = 0;
+    while (n != sz) {
+        size_t chunk = std::min(sz - n, (size_t) 1 << 30);
+        ssize_t r;
+        if (method < 3) {
+            ++wst.ntransfers;
+        }
+        if (method == 0) {
+            r = copy_file_range(infd, nullptr, outfd, nullptr, chunk, 0);
+        } else if (method == 1) {
+            r = splice(infd, nullptr, outfd, nullptr, chunk, SPLICE_F_MOVE);
+        } else if (method == 2) {
+            r = sendfile(outfd, infd, nullptr, chunk);
+        } else {
+            unsigned char buf[65536];
+            ++rst.nreads;
+            r = read(infd, buf, std::min(chunk, sizeof(buf)));
+            for (ssize_t nw = 0; r > 0 && nw != r; ) {
+                ++wst.nwrites;
+                ssize_t w = write(outfd, &buf[nw], r - nw);
+                if (w >= 0) {
+                    nw += w;
+                } else if (errno == EAGAIN && io61_poll(outfd, POLLOUT) == 0) {
+                    continue;
+                } else if (errno != EINTR) {
+                    return -1;
+                }
+            }
+        }
+
+        if (r > 0) {
+            n += r;
+        } else if (r == 0) {
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN) {
+            // Either end may be the one that isn't ready
+            if (io61_poll(infd, POLLIN) == -1 || io61_poll(outfd, POLLOUT) == -1) {
+                return n ? (ssize_t) n : -1;
+            }
+        } else if (n == 0
+                   && method < 3
+                   && (errno == EINVAL || errno == EXDEV || errno == EBADF
+                       || errno == ENOSYS || errno == EOPNOTSUPP)) {
+            ++method;
+        } else {
+            return n ? (ssize_t) n : -1;
+        }
+    }
+    return n;
+}
+
+
+// io61_transfer(inf, outf, sz)
+//    Copies up to `sz` bytes from `inf` to `outf`. Returns the number of
+//    bytes copied, 0 if `inf` is at end of file, or -1 if an error occurs
+//    before anything is copied.
+//
+//    Data already cached for `inf` goes to `outf` first, and `outf` is
+//    flushed; after that the bytes move inside the kernel without passing
+//    through either cache. Read-ahead is paused for the copy, and direct
+//    I/O (which the kernel copy can't use) resumes at the next fill or
+//    flush.
+
+ssize_t io61_transfer(io61_file* inf, io61_file* outf, size_t sz) {
+    io61_fcache* read_cache = read_caches[inf->fd];
+    io61_fcache* write_cache = write_caches[outf->fd];
+
+    // Make the input file position match the read cache
+    bool readahead = read_cache->ra != nullptr;
+    if (readahead && io61_set_readahead(inf, 0) == -1) {
+        return -1;
+    }
+    if (read_cache->u.enabled && io61_uring_settle(read_cache) == -1) {
+        return -1;
+    }
+
+    // Pass along cached input, then empty the output cache
+    size_t ncopied = std::min(sz, (size_t) (read_cache->end_tag - read_cache->pos_tag));
+    if (ncopied > 0) {
+        const unsigned char* p = &read_cache->cbuf[read_cache->pos_tag - read_cache->tag];
+        if (io61_write(outf, p, ncopied) != (ssize_t) ncopied) {
+            return -1;
+        }
+        read_cache->pos_tag += ncopied;
+    }
+    if (io61_flush(outf) == -1) {
+        return -1;
+    }
+
+    // Move the rest in the kernel; both caches are now empty. The kernel
+    // copy doesn't meet O_DIRECT's alignment rules, so it runs buffered
+    ssize_t nmoved = 0;
+    if (ncopied != sz) {
+        io61_set_odirect(read_cache, false);
+        io61_set_odirect(write_cache, false);
+        nmoved = io61_transfer_fd(inf->fd, outf->fd, sz - ncopied,
+                                  read_cache->st, write_cache->st);
+        if (nmoved > 0) {
+            read_cache->st.bytes_read += nmoved;
+            write_cache->st.bytes_written += nmoved;
+            read_cache->end_tag += nmoved;
+            read_cache->tag = read_cache->pos_tag = read_cache->end_tag;
+            write_cache->end_tag += nmoved;
+            write_cache->tag = write_cache->pos_tag = write_cache->end_tag;
+            ncopied += nmoved;
+        }
+    }
+
+    if (readahead) {
+        io61_set_readahead(inf, 1);
+    }
+    if (ncopied != 0 || nmoved != -1) {
+        return ncopied;
+    } else {
+        return -1;
+    }
+}
+
+
 // io61_seek(f, pos)
 //    Changes the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
@@ -344,11 +1737,21 @@ int io61_seek(io61_file* f, off_t pos) {
 int io61_seek_read(io61_fcache* cache, off_t pos) {
     // Determine if entire cache needs to be shifted
     if (pos < cache->tag || cache->end_tag < pos) {
+        if (cache->ra) {
+            io61_readahead_discard(cache);
+        } else if (cache->u.enabled && io61_uring_settle(cache) == -1) {
+            return -1;
+        }
         off_t seek_pos = std::max(pos - (off_t) cache->bufsize/2, (off_t) 0);
+        if (cache->direct) {
+            seek_pos &= ~(off_t) (io61_direct_align - 1);
+        }
         off_t sought_pos = lseek(cache->fd, seek_pos, SEEK_SET);
+        ++cache->st.nseeks;
         if (sought_pos == seek_pos) {
             // Make sure we refill cache from correct position
             cache->tag = cache->pos_tag = cache->end_tag = sought_pos;
+            ++cache->st.misses;
             int nfilled = io61_fill(cache);
             cache->pos_tag = pos;
             
@@ -372,7 +1775,11 @@ int io61_seek_write(io61_file* f, io61_fcache* cache, off_t pos) {
         if (cache->pos_tag - cache->tag > 0) {
             io61_flush(f);
         }
+        if (cache->u.enabled && io61_uring_settle(cache) == -1) {
+            return -1;
+        }
         off_t sought_pos = lseek(cache->fd, pos, SEEK_SET);
+        ++cache->st.nseeks;
         if (sought_pos == pos) {
             cache->tag = cache->pos_tag = cache->end_tag = pos;
 
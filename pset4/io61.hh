@@ -26,11 +26,26 @@ int io61_writec(io61_file* f, int ch);
 
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz);
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz);
+ssize_t io61_transfer(io61_file* inf, io61_file* outf, size_t sz);
+
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr);
+void io61_consume(io61_file* f, size_t n);
+ssize_t io61_reserve(io61_file* f, unsigned char** ptr);
+int io61_commit(io61_file* f, size_t n);
 
 int io61_flush(io61_file* f);
+ssize_t io61_try_flush(io61_file* f);
+
+int io61_set_bufsize(io61_file* f, size_t sz);
+int io61_set_readahead(io61_file* f, int enable);
+int io61_set_uring(io61_file* f, int enable);
+int io61_set_direct(io61_file* f, int enable);
 
 int fd_open_check(const char* filename, int mode);
 FILE* stdio_open_check(const char* filename, int mode);
+double monotonic_timestamp();
+void io61_wait_ready(io61_file* f, short events);
 
 
 struct io61_args {
@@ -53,6 +68,11 @@ struct io61_args {
     double delay = 0.0;                 // `-D`: delay
     size_t pipebuf_size = 0;            // `-B`: pipe buffer size
     bool nonblocking = false;           // `-n`: nonblocking
+    bool readahead = false;             // `-R`: read ahead in background
+    bool uring = false;                 // `-U`: use io_uring
+    bool transfer = false;              // `-Z`: copy with `io61_transfer`
+    bool window = false;                // `-W`: copy with `io61_peek`
+    bool direct = false;                // `-O`: use O_DIRECT
 
     explicit io61_args(const char* opts, size_t block_size = 0);
 
@@ -1,30 +1,19 @@
 #include "io61.hh"
 #include <vector>
 
-// Usage: ./scattergather61 [-b BLOCKSIZE] [-i IFILE | -o OFILE]...
+// Usage: ./scattergather61 [-b BLOCKSIZE] [-U] [-i IFILE | -o OFILE]...
 //    Copies the input IFILEs to the output OFILEs, alternating
 //    with every block. (I.e., read from IFILE1 and write to OFILE1,
 //    then read from IFILE2 and write to OFILE2, etc. There may be
 //    different numbers of IFILEs and OFILEs.) This is a
 //    "scatter/gather" I/O pattern: input is "gathered" from many
 //    input files and "scattered" to many output files.
-//    Default BLOCKSIZE is 1.
+//    Default BLOCKSIZE is 1. `-U` batches the files' reads and writes
+//    with io_uring.
 
 ssize_t read_line(io61_file* f, unsigned char* buf, size_t sz, bool lines) {
     if (lines) {
-        size_t i = 0;
-        while (i != sz) {
-            int ch = io61_readc(f);
-            if (ch == EOF) {
-                break;
-            }
-            buf[i] = ch;
-            ++i;
-            if (ch == '\n') {
-                break;
-            }
-        }
-        return i;
+        return io61_readline(f, buf, sz);
     } else {
         return io61_read(f, buf, sz);
     }
@@ -33,7 +22,7 @@ ssize_t read_line(io61_file* f, unsigned char* buf, size_t sz, bool lines) {
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("b:i:o:l##", 1).parse(argc, argv);
+    io61_args args = io61_args("b:i:o:lU##", 1).parse(argc, argv);
 
     // Allocate buffer, open files
     unsigned char* buf = new unsigned char[args.block_size];
@@ -41,10 +30,12 @@ int main(int argc, char* argv[]) {
     std::vector<io61_file*> infs, outfs;
     for (auto filename : args.input_files) {
         auto f = io61_open_check(filename, O_RDONLY);
+        args.after_open(f, O_RDONLY);
         infs.push_back(f);
     }
     for (auto filename : args.output_files) {
         auto f = io61_open_check(filename, O_WRONLY | O_CREAT | O_TRUNC);
+        args.after_open(f, O_WRONLY);
         outfs.push_back(f);
     }
 
@@ -13,6 +13,8 @@
 
 struct io61_file {
     int fd = -1;     // file descriptor
+    int peeked = -1; // byte read by `io61_peek`, or -1
+    unsigned char window[1];    // `io61_peek`/`io61_reserve` byte
 };
 
 
@@ -46,6 +48,11 @@ int io61_close(io61_file* f) {
 //    which equals -1, on end of file or error.
 
 int io61_readc(io61_file* f) {
+    if (f->peeked >= 0) {
+        int ch = f->peeked;
+        f->peeked = -1;
+        return ch;
+    }
     unsigned char buf[1];
     ssize_t nr = read(f->fd, buf, 1);
     if (nr == 1) {
@@ -88,6 +95,84 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
 }
 
 
+// io61_readline(f, buf, sz)
+//    Reads up to `sz` bytes from `f` into `buf`, stopping after the first
+//    newline. Returns the number of bytes read (including the newline),
+//    0 at end of file, or -1 on error.
+
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread != sz) {
+        int ch = io61_readc(f);
+        if (ch == EOF) {
+            break;
+        }
+        buf[nread] = ch;
+        ++nread;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    if (nread != 0 || sz == 0 || errno == 0) {
+        return nread;
+    } else {
+        return -1;
+    }
+}
+
+
+// io61_peek(f, ptr)
+//    Sets `*ptr` to the bytes buffered for reading at `f`'s position and
+//    returns how many there are, 0 at end of file, or -1 on error. This
+//    version has no cache, so it reads and holds one byte.
+
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr) {
+    if (f->peeked < 0) {
+        f->peeked = io61_readc(f);
+        if (f->peeked < 0) {
+            return errno == 0 ? 0 : -1;
+        }
+    }
+    f->window[0] = f->peeked;
+    *ptr = f->window;
+    return 1;
+}
+
+
+// io61_consume(f, n)
+//    Advances `f` past `n` bytes returned by `io61_peek`.
+
+void io61_consume(io61_file* f, size_t n) {
+    assert(n <= 1);
+    if (n == 1) {
+        f->peeked = -1;
+    }
+}
+
+
+// io61_transfer(inf, outf, sz)
+//    Copies up to `sz` bytes from `inf` to `outf`. Returns the number of
+//    bytes copied, 0 if `inf` is at end of file, or -1 if an error occurs
+//    before anything is copied. This version copies through a buffer.
+
+ssize_t io61_transfer(io61_file* inf, io61_file* outf, size_t sz) {
+    unsigned char buf[8192];
+    size_t n = 0;
+    while (n != sz) {
+        size_t m = sz - n < sizeof(buf) ? sz - n : sizeof(buf);
+        ssize_t nr = io61_read(inf, buf, m);
+        if (nr <= 0) {
+            return n ? (ssize_t) n : nr;
+        }
+        if (io61_write(outf, buf, nr) != nr) {
+            return -1;
+        }
+        n += nr;
+    }
+    return n;
+}
+
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success and
 //    -1 on error.
@@ -127,6 +212,26 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 }
 
 
+// io61_reserve(f, ptr)
+//    Sets `*ptr` to space for output to `f` and returns its size. This
+//    version hands out one byte at a time.
+
+ssize_t io61_reserve(io61_file* f, unsigned char** ptr) {
+    *ptr = f->window;
+    return 1;
+}
+
+
+// io61_commit(f, n)
+//    Writes the first `n` bytes of the space returned by `io61_reserve`.
+//    Returns 0 on success and -1 on error.
+
+int io61_commit(io61_file* f, size_t n) {
+    assert(n <= 1);
+    return n == 1 ? io61_writec(f, f->window[0]) : 0;
+}
+
+
 // io61_flush(f)
 //    Forces a write of any cached data written to `f`. Returns 0 on
 //    success. Returns -1 if an error is encountered before all cached
@@ -141,11 +246,63 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_try_flush(f)
+//    Writes data cached for `f` without waiting. Returns the number of
+//    bytes written, or -1 on error. This version has no cache, so it
+//    returns 0.
+
+ssize_t io61_try_flush(io61_file* f) {
+    (void) f;
+    return 0;
+}
+
+
+// io61_set_bufsize(f, sz)
+//    Changes the cache size of `f`. This version has no cache, so it
+//    does nothing.
+
+int io61_set_bufsize(io61_file* f, size_t sz) {
+    (void) f, (void) sz;
+    return 0;
+}
+
+
+// io61_set_readahead(f, enable)
+//    Turns background read-ahead on or off. This version has no cache,
+//    so it does nothing.
+
+int io61_set_readahead(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return 0;
+}
+
+
+// io61_set_uring(f, enable)
+//    Moves `f` onto or off the io_uring backend. This version does not
+//    use io_uring, so it does nothing.
+
+int io61_set_uring(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return 0;
+}
+
+
+// io61_set_direct(f, enable)
+//    Turns O_DIRECT I/O on or off. This version does not support direct
+//    I/O, so it does nothing.
+
+int io61_set_direct(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return 0;
+}
+
+
 // io61_seek(f, pos)
 //    Changes the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
+    f->peeked = -1;
     off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
     if (r == (off_t) pos) {
         return 0;
@@ -13,6 +13,7 @@
 
 struct io61_file {
     FILE* f;
+    unsigned char window[1];    // `io61_peek`/`io61_reserve` byte
 };
 
 
@@ -69,6 +70,83 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
 }
 
 
+// io61_readline(f, buf, sz)
+//    Reads up to `sz` bytes from `f` into `buf`, stopping after the first
+//    newline. Returns the number of bytes read (including the newline),
+//    0 at end of file, or -1 on error.
+
+ssize_t io61_readline(io61_file* f, unsigned char* buf, size_t sz) {
+    size_t n = 0;
+    while (n != sz) {
+        int ch = fgetc(f->f);
+        if (ch == EOF) {
+            break;
+        }
+        buf[n] = ch;
+        ++n;
+        if (ch == '\n') {
+            break;
+        }
+    }
+    if (n != 0 || sz == 0 || !ferror(f->f)) {
+        return (ssize_t) n;
+    } else {
+        return (ssize_t) -1;
+    }
+}
+
+
+// io61_peek(f, ptr)
+//    Sets `*ptr` to the bytes buffered for reading at `f`'s position and
+//    returns how many there are, 0 at end of file, or -1 on error. stdio
+//    hides its buffer, so this version peeks at one byte with `ungetc`.
+
+ssize_t io61_peek(io61_file* f, const unsigned char** ptr) {
+    int ch = fgetc(f->f);
+    if (ch == EOF) {
+        return ferror(f->f) ? -1 : 0;
+    }
+    ungetc(ch, f->f);
+    f->window[0] = ch;
+    *ptr = f->window;
+    return 1;
+}
+
+
+// io61_consume(f, n)
+//    Advances `f` past `n` bytes returned by `io61_peek`.
+
+void io61_consume(io61_file* f, size_t n) {
+    assert(n <= 1);
+    if (n == 1) {
+        fgetc(f->f);
+    }
+}
+
+
+// io61_transfer(inf, outf, sz)
+//    Copies up to `sz` bytes from `inf` to `outf`. Returns the number of
+//    bytes copied, 0 if `inf` is at end of file, or -1 if an error occurs
+//    before anything is copied. This version copies through a buffer.
+
+ssize_t io61_transfer(io61_file* inf, io61_file* outf, size_t sz) {
+    unsigned char buf[8192];
+    size_t n = 0;
+    while (n != sz) {
+        size_t m = sz - n < sizeof(buf) ? sz - n : sizeof(buf);
+        ssize_t nr = io61_read(inf, buf, m);
+        if (nr <= 0) {
+            return n ? (ssize_t) n : nr;
+        }
+        if (io61_write(outf, buf, nr) != nr) {
+            return -1;
+        }
+        n += nr;
+    }
+    return n;
+}
+
+
 // io61_writec(f)
 //    Write a single character `ch` to `f`. Returns 0 on success and
 //    -1 on error.
@@ -113,6 +191,81 @@ int io61_flush(io61_file* f) {
 }
 
 
+// io61_reserve(f, ptr)
+//    Sets `*ptr` to space for output to `f` and returns its size. This
+//    version hands out one byte at a time.
+
+ssize_t io61_reserve(io61_file* f, unsigned char** ptr) {
+    *ptr = f->window;
+    return 1;
+}
+
+
+// io61_commit(f, n)
+//    Writes the first `n` bytes of the space returned by `io61_reserve`.
+//    Returns 0 on success and -1 on error.
+
+int io61_commit(io61_file* f, size_t n) {
+    assert(n <= 1);
+    if (n == 1 && fputc(f->window[0], f->f) == EOF) {
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_try_flush(f)
+//    Writes data cached for `f` without waiting. Returns the number of
+//    bytes written, or -1 on error. This version flushes the whole stdio
+//    buffer and cannot report partial progress, so it returns 0.
+
+ssize_t io61_try_flush(io61_file* f) {
+    return fflush(f->f) == 0 ? 0 : -1;
+}
+
+
+// io61_set_bufsize(f, sz)
+//    Changes the stdio buffer size of `f`. Must be called before any
+//    other operation on `f`. If `sz` is 0, keeps stdio's default.
+
+int io61_set_bufsize(io61_file* f, size_t sz) {
+    if (sz == 0) {
+        return 0;
+    }
+    return setvbuf(f->f, nullptr, _IOFBF, sz) == 0 ? 0 : -1;
+}
+
+
+// io61_set_readahead(f, enable)
+//    Turns background read-ahead on or off. This version has no cache,
+//    so it does nothing.
+
+int io61_set_readahead(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return 0;
+}
+
+
+// io61_set_uring(f, enable)
+//    Moves `f` onto or off the io_uring backend. This version does not
+//    use io_uring, so it does nothing.
+
+int io61_set_uring(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return 0;
+}
+
+
+// io61_set_direct(f, enable)
+//    Turns O_DIRECT I/O on or off. This version does not support direct
+//    I/O, so it does nothing.
+
+int io61_set_direct(io61_file* f, int enable) {
+    (void) f, (void) enable;
+    return 0;
+}
+
+
 // io61_seek(f, pos)
 //    Changes the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
@@ -0,0 +1,75 @@
+#include "io61.hh"
+
+// Usage: ./sweepcat61 [-b BLOCKSIZE] [-o OUTFILE] FILE
+//    Copies FILE to OUTFILE in blocks once for every cache size from 4KB
+//    to 4MB, then reports the throughput of each cache size and the best
+//    one on standard error. OUTFILE (default /dev/null) is rewritten for
+//    every cache size. Default BLOCKSIZE is 4096.
+
+static double copy_with_bufsize(const io61_args& args, unsigned char* buf,
+                                size_t bufsize, size_t* nbytes) {
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file,
+                                      O_WRONLY | O_CREAT | O_TRUNC);
+    int r = io61_set_bufsize(inf, bufsize);
+    assert(r == 0);
+    r = io61_set_bufsize(outf, bufsize);
+    assert(r == 0);
+
+    double start = monotonic_timestamp();
+    *nbytes = 0;
+    while (true) {
+        ssize_t nr = io61_read(inf, buf, args.block_size);
+        if (nr <= 0) {
+            break;
+        }
+
+        ssize_t nw = io61_write(outf, buf, nr);
+        assert(nw == nr);
+        *nbytes += nw;
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    return monotonic_timestamp() - start;
+}
+
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:o:", 4096).parse(argc, argv);
+    if (!args.input_file) {
+        fprintf(stderr, "sweepcat61: need a named input file\n");
+        exit(1);
+    }
+    if (!args.output_file) {
+        args.output_file = "/dev/null";
+    }
+
+    // Allocate buffer
+    unsigned char* buf = new unsigned char[args.block_size];
+
+    // Try each cache size three times and keep the fastest run
+    size_t best_bufsize = 0;
+    double best_rate = 0;
+    for (size_t bufsize = 4096; bufsize <= (4 << 20); bufsize *= 2) {
+        double best_elapsed = 0;
+        size_t nbytes = 0;
+        for (int trial = 0; trial != 3; ++trial) {
+            double elapsed = copy_with_bufsize(args, buf, bufsize, &nbytes);
+            if (trial == 0 || elapsed < best_elapsed) {
+                best_elapsed = elapsed;
+            }
+        }
+
+        double rate = nbytes / std::max(best_elapsed, 1e-9) / 1e6;
+        fprintf(stderr, "bufsize %8zu: %10.1f MB/s\n", bufsize, rate);
+        if (rate > best_rate) {
+            best_bufsize = bufsize;
+            best_rate = rate;
+        }
+    }
+    fprintf(stderr, "best bufsize %zu (%.1f MB/s)\n", best_bufsize, best_rate);
+
+    delete[] buf;
+}
@@ -0,0 +1,107 @@
+#! /usr/bin/perl -w
+
+# bench-ftx.pl
+#    This program benchmarks `ftxxfer` transfer engines against one
+#    another over a range of thread counts and writes one CSV row per
+#    setting. The engines are `locks` (range locks on the database file),
+#    `table` (`-T`, per-account mutexes in the in-memory table), and
+#    `optimistic` (`-C`, lock-free optimistic transfers on the table).
+#    Each row reports the best of TRIALS runs: real time, CPU time,
+#    transfers per second, and (for `optimistic`) the number of reruns.
+#    Every run is checked with `diff-ftxdb.pl`, so a row only counts if
+#    the run conserved money.
+#
+#    Settings come from the environment (comma-separated lists):
+#      BENCH_ENGINES   engines to run (default locks,table,optimistic)
+#      BENCH_THREADS   `-j` values (default 1,2,4,8,16,32,64)
+#      BENCH_OPS       `-n` value, transfers per thread (default 2000)
+#      BENCH_DB        account database (default accounts.fdb)
+#      BENCH_OUT       CSV file (default bench-ftx.csv)
+#      TRIALS          runs per setting (default 3)
+#      MAXTIME         seconds before a run is killed (default 60)
+#
+#    Run it with `make bench`.
+
+sub nonemptyenv ($) {
+    my ($e) = @_;
+    return exists($ENV{$e}) && $ENV{$e} ne "" && $ENV{$e} ne " ";
+}
+
+sub listenv ($$) {
+    my ($e, $default) = @_;
+    return split(/[,\s]+/, nonemptyenv($e) ? $ENV{$e} : $default);
+}
+
+# the `ftxxfer` option for each engine
+my (%ENGINEOPTS) = (
+    "locks" => "",
+    "table" => " -T",
+    "optimistic" => " -C"
+);
+
+my (@engines) = listenv("BENCH_ENGINES", "locks,table,optimistic");
+my (@threads) = listenv("BENCH_THREADS", "1,2,4,8,16,32,64");
+my ($nops) = nonemptyenv("BENCH_OPS") ? int($ENV{"BENCH_OPS"}) : 2000;
+my ($db) = nonemptyenv("BENCH_DB") ? $ENV{"BENCH_DB"} : "accounts.fdb";
+my ($out) = nonemptyenv("BENCH_OUT") ? $ENV{"BENCH_OUT"} : "bench-ftx.csv";
+my ($trials) = nonemptyenv("TRIALS") ? int($ENV{"TRIALS"}) : 3;
+my ($maxtime) = nonemptyenv("MAXTIME") ? $ENV{"MAXTIME"} + 0 : 60;
+$nops = 2000 if $nops <= 0;
+$trials = 3 if $trials <= 0;
+$maxtime = 60 if $maxtime <= 0;
+
+foreach my $e (@engines) {
+    die "*** $e: unknown engine\n" if !exists($ENGINEOPTS{$e});
+}
+foreach my $j (@threads) {
+    die "*** $j: invalid thread count\n" if $j !~ /\A[1-9]\d*\z/;
+}
+die "*** $db: cannot read\n" if !-r $db;
+
+# run_xfer($cmd)
+#    Runs `$cmd` under a time limit, checks the result, and returns
+#    (real seconds, CPU seconds, retries), or an empty list if the run
+#    failed, was killed, or lost money.
+sub run_xfer ($) {
+    my ($cmd) = @_;
+    my ($result) = scalar `timeout -s KILL $maxtime $cmd 2>&1 >/dev/null`;
+    return () if $? != 0
+        || $result !~ /([\d.]+)s CPU time, ([\d.]+)s real time/;
+    my ($cpu, $real) = ($1, $2);
+    my ($retries) = $result =~ /^(\d+) retr/m ? $1 : "";
+    return () if system("./diff-ftxdb.pl $db >/dev/null 2>&1") != 0;
+    return ($real, $cpu, $retries);
+}
+
+system("make", "-s", "SAN=0", "ftxxfer") == 0
+    or die "*** make failed\n";
+
+open(CSV, ">", $out) or die "*** $out: $!\n";
+print CSV "engine,threads,operations,seconds,cpu,opsps,retries\n";
+my ($nruns) = 0;
+
+foreach my $j (@threads) {
+    foreach my $engine (@engines) {
+        my ($cmd) = "./ftxxfer -j $j -n $nops$ENGINEOPTS{$engine} $db";
+        my (@best);
+        for (my $i = 0; $i < $trials; ++$i) {
+            my (@r) = run_xfer($cmd);
+            last if !@r;
+            @best = @r if !@best || $r[0] < $best[0];
+        }
+        my ($ops) = $j * $nops;
+        my ($secs, $cpu, $opsps, $retries) = ("", "", "", "");
+        if (@best) {
+            ($secs, $cpu, $retries) = @best;
+            $opsps = sprintf("%.0f", $ops / ($secs > 0 ? $secs : 1e-9));
+        }
+        print CSV join(",", $engine, $j, $ops, $secs, $cpu, $opsps, $retries), "\n";
+        printf STDERR "%-10s j %-3d %s\n", $engine, $j,
+            @best ? "$opsps ops/s, ${cpu}s CPU" . ($retries ne "" ? ", $retries retries" : "")
+                  : "FAILED/TIMEOUT";
+        ++$nruns;
+    }
+}
+
+close(CSV);
+print STDERR "$nruns runs written to $out\n";
@@ -0,0 +1,148 @@
+#! /usr/bin/perl -w
+
+# bench-wal.pl
+#    This program measures `ftxxfer` transfer throughput against
+#    durability level, to help pick a write-ahead log sync policy and
+#    group commit delay, and writes one CSV row per setting. Policy
+#    `none` runs without a log (`-T` only); the others run with `-W`
+#    and `-S POLICY`, and `flush` and `fsync` also try each group commit
+#    delay (`-G`). Each row reports the best of TRIALS runs, the number
+#    of group commits, and the average number of log records per commit.
+#
+#    Unless BENCH_CRASH is 0, each logged setting is also crash-tested:
+#    a long run is killed with SIGKILL, the log is replayed with
+#    `ftxxfer -M -W WAL -n 0`, and `diff-ftxdb.pl` checks that the
+#    recovered database still holds all the money.
+#
+#    Settings come from the environment (comma-separated lists):
+#      BENCH_POLICIES  policies (default none,buffered,flush,fsync)
+#      BENCH_DELAYS    `-G` values in microseconds (default 0,100,1000)
+#      BENCH_THREADS   `-j` value (default 16)
+#      BENCH_OPS       `-n` value, transfers per thread (default 2000)
+#      BENCH_CRASH     1 to crash-test each setting (default 1)
+#      BENCH_OUT       CSV file (default bench-wal.csv)
+#      TRIALS          runs per setting (default 3)
+#      MAXTIME         seconds before a run is killed (default 60)
+#
+#    Run it with `make bench-wal`.
+
+use Time::HiRes;
+
+sub nonemptyenv ($) {
+    my ($e) = @_;
+    return exists($ENV{$e}) && $ENV{$e} ne "" && $ENV{$e} ne " ";
+}
+
+sub listenv ($$) {
+    my ($e, $default) = @_;
+    return split(/[,\s]+/, nonemptyenv($e) ? $ENV{$e} : $default);
+}
+
+my (@policies) = listenv("BENCH_POLICIES", "none,buffered,flush,fsync");
+my (@delays) = listenv("BENCH_DELAYS", "0,100,1000");
+my ($nthreads) = nonemptyenv("BENCH_THREADS") ? int($ENV{"BENCH_THREADS"}) : 16;
+my ($nops) = nonemptyenv("BENCH_OPS") ? int($ENV{"BENCH_OPS"}) : 2000;
+my ($crash) = nonemptyenv("BENCH_CRASH") ? int($ENV{"BENCH_CRASH"}) : 1;
+my ($out) = nonemptyenv("BENCH_OUT") ? $ENV{"BENCH_OUT"} : "bench-wal.csv";
+my ($trials) = nonemptyenv("TRIALS") ? int($ENV{"TRIALS"}) : 3;
+my ($maxtime) = nonemptyenv("MAXTIME") ? $ENV{"MAXTIME"} + 0 : 60;
+$nthreads = 16 if $nthreads <= 0;
+$nops = 2000 if $nops <= 0;
+$trials = 3 if $trials <= 0;
+$maxtime = 60 if $maxtime <= 0;
+
+foreach my $p (@policies) {
+    die "*** $p: unknown policy\n" if $p !~ /\A(?:none|buffered|flush|fsync)\z/;
+}
+foreach my $d (@delays) {
+    die "*** $d: invalid delay\n" if $d !~ /\A\d+\z/;
+}
+
+my ($wal) = "/tmp/ftxbench.wal";
+my ($crashdb) = "/tmp/ftxcrash.fdb";
+
+sub options ($$) {
+    my ($policy, $delay) = @_;
+    return " -T" if $policy eq "none";
+    return " -W $wal -S $policy" . ($delay ? " -G $delay" : "");
+}
+
+# run_xfer($opts)
+#    Runs `ftxxfer` with `$opts` under a time limit, checks the result,
+#    and returns (real seconds, group commits, log records), or an
+#    empty list if the run failed, was killed, or lost money.
+sub run_xfer ($) {
+    my ($opts) = @_;
+    unlink($wal);
+    my ($result) = scalar `IO61_STATS=1 timeout -s KILL $maxtime ./ftxxfer -j $nthreads -n $nops$opts 2>&1 >/dev/null`;
+    return () if $? != 0 || $result !~ /([\d.]+)s real time/;
+    my ($real) = $1;
+    my ($records, $commits) = $result =~ /^ledger fd \d+: (\d+) records, (\d+) group commits/m
+        ? ($1, $2) : ("", "");
+    return () if system("./diff-ftxdb.pl >/dev/null 2>&1") != 0;
+    return ($real, $commits, $records);
+}
+
+# crash_test($opts)
+#    Kills a long `ftxxfer` run partway through, replays its log, and
+#    returns (number of updates replayed, "OK" or "FAIL").
+sub crash_test ($) {
+    my ($opts) = @_;
+    unlink($wal);
+    system("cp accounts.fdb $crashdb") == 0 or return ("", "FAIL");
+    my ($pid) = fork();
+    if ($pid == 0) {
+        open(STDOUT, ">", "/dev/null");
+        open(STDERR, ">", "/dev/null");
+        exec("./ftxxfer -M -j $nthreads -n 100000000$opts $crashdb");
+        exit(1);
+    }
+    Time::HiRes::sleep(0.5);
+    kill("KILL", $pid);
+    waitpid($pid, 0);
+    my ($result) = scalar `timeout -s KILL $maxtime ./ftxxfer -M -W $wal -n 0 $crashdb 2>&1 >/dev/null`;
+    return ("", "FAIL") if $? != 0;
+    my ($replayed) = $result =~ /replayed (\d+) updates/ ? $1 : 0;
+    my ($ok) = system("./diff-ftxdb.pl accounts.fdb $crashdb >/dev/null 2>&1") == 0;
+    return ($replayed, $ok ? "OK" : "FAIL");
+}
+
+system("make", "-s", "SAN=0", "ftxxfer") == 0
+    or die "*** make failed\n";
+
+open(CSV, ">", $out) or die "*** $out: $!\n";
+print CSV "policy,delay,threads,operations,seconds,opsps,commits,records_per_commit,crash_replayed,crash_recovery\n";
+my ($nruns) = 0;
+
+foreach my $policy (@policies) {
+    foreach my $delay ($policy =~ /\A(?:flush|fsync)\z/ ? @delays : (0)) {
+        my ($opts) = options($policy, $delay);
+        my (@best);
+        for (my $i = 0; $i < $trials; ++$i) {
+            my (@r) = run_xfer($opts);
+            last if !@r;
+            @best = @r if !@best || $r[0] < $best[0];
+        }
+        my ($ops) = $nthreads * $nops;
+        my ($secs, $opsps, $commits, $per) = ("", "", "", "");
+        if (@best) {
+            $secs = $best[0];
+            $opsps = sprintf("%.0f", $ops / ($secs > 0 ? $secs : 1e-9));
+            $commits = $best[1];
+            $per = sprintf("%.1f", $best[2] / $commits) if $commits ne "" && $commits > 0;
+        }
+        my ($replayed, $recovery) = ("", "");
+        ($replayed, $recovery) = crash_test($opts) if $crash && $policy ne "none";
+        print CSV join(",", $policy, $delay, $nthreads, $ops, $secs, $opsps,
+                       $commits, $per, $replayed, $recovery), "\n";
+        printf STDERR "%-8s G %-5s %s%s\n", $policy, $delay,
+            @best ? "$opsps ops/s" . ($per ne "" ? ", $per records/commit" : "")
+                  : "FAILED/TIMEOUT",
+            $recovery ne "" ? ", crash recovery $recovery" : "";
+        ++$nruns;
+    }
+}
+
+close(CSV);
+unlink($wal, $crashdb);
+print STDERR "$nruns runs written to $out\n";
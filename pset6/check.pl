@@ -306,6 +306,12 @@ run_one_check("./ftxblockchain", "./diff-ftxdb.pl -l");
 print OUT "\n${Cyan}./ftxxfer bigaccounts.fdb check...${Off}\n";
 run_one_check("./ftxxfer bigaccounts.fdb", "./diff-ftxdb.pl bigaccounts.fdb");
 
+print OUT "\n${Cyan}./pcopy61 -j 8 -b 100000 check...${Off}\n";
+system("make", "SAN=0", "pcopy61");
+system("head -c 4000000 /dev/urandom > /tmp/pcopy61.in");
+run_one_check("./pcopy61 -j 8 -b 100000 -o /tmp/pcopy61.out /tmp/pcopy61.in",
+              "cmp /tmp/pcopy61.in /tmp/pcopy61.out && echo /tmp/pcopy61.out OK");
+
 
 print OUT "\n${Cyan}Building with sanitizers...${Off}\n";
 system("make", "SAN=1", "ftxxfer");
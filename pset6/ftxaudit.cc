@@ -0,0 +1,182 @@
+#include "ftxdb.hh"
+#include <sys/resource.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+
+// Usage: ./ftxaudit [-j NTHREADS] [-J NWRITERS] [-n NOPS] [-X] [FILE]
+//    A read-heavy workload. NTHREADS - NWRITERS threads each perform NOPS
+//    balance inquiries within FILE, while NWRITERS threads (default 1)
+//    perform “bank transfers” until the inquiries are done. Every 64th
+//    inquiry is a full audit that sums every balance under one shared
+//    lock on the whole file and checks that the total never changes.
+//    Inquiries and audits take shared locks, so they run alongside each
+//    other; `-X` makes them take exclusive locks instead, for comparison.
+
+static std::atomic<bool> inquiries_done = false;
+
+static void transfer_thread(ftx_db& db, size_t& opcount, unsigned seed) {
+    // Obtain a source of random account numbers
+    std::mt19937 randomness(seed);
+    std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
+    std::normal_distribution pick_amount(100.0, 10.0);
+
+    size_t i = 0;
+    while (!inquiries_done) {
+        // Pick two random accounts for transfer
+        size_t aindex[2] = {
+            pick_account(randomness), pick_account(randomness)
+        };
+        if (aindex[0] == aindex[1]) {
+            continue;
+        }
+
+        // Lock both accounts; prevent deadlock with lock ordering
+        ftx_acct acct1{db, aindex[0]};
+        ftx_acct acct2{db, aindex[1]};
+        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
+        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+
+        // Read current balances
+        long bal[2];
+        acct1.read(nullptr, 0, &bal[0]);
+        acct2.read(nullptr, 0, &bal[1]);
+
+        // Model network delay or heavy computation
+        usleep(1);
+
+        // Compute amount to transfer
+        long delta = std::min(bal[0], (long) pick_amount(randomness));
+        delta = std::min(delta, 9999999 - bal[1]);
+        bal[0] -= delta;
+        bal[1] += delta;
+
+        // Update balances
+        acct1.write(bal[0]);
+        acct2.write(bal[1]);
+
+        ++i;
+        guard2.unlock();
+        guard1.unlock();
+
+        // Transfers are rare compared with inquiries
+        usleep(100);
+    }
+    opcount = i;
+}
+
+
+// Sum every balance in `db`
+static long audit(ftx_db& db, int locktype) {
+    off_t len = db.naccounts * db.asize;
+    int r = io61_lock(db.f, 0, len, locktype);
+    assert(r == 0);
+
+    long total = 0;
+    for (size_t a = 0; a != db.naccounts; ++a) {
+        long bal;
+        r = ftx_acct{db, a}.read(nullptr, 0, &bal);
+        assert(r == 0);
+        total += bal;
+    }
+
+    // Model report generation
+    usleep(100);
+
+    r = io61_unlock(db.f, 0, len);
+    assert(r == 0);
+    return total;
+}
+
+
+static void inquiry_thread(ftx_db& db, size_t nops, size_t& opcount,
+                           bool exclusive, long expected_total,
+                           unsigned seed) {
+    // Obtain a source of random account numbers
+    std::mt19937 randomness(seed);
+    std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
+
+    for (size_t i = 0; i != nops; ++i) {
+        if (i % 64 == 63) {
+            long total = audit(db, exclusive ? LOCK_EX : LOCK_SH);
+            if (total != expected_total) {
+                fprintf(stderr, "ftxaudit: audit found total %ld, expected %ld\n",
+                        total, expected_total);
+                exit(1);
+            }
+            continue;
+        }
+
+        // Look up one balance
+        ftx_acct acct{db, pick_account(randomness)};
+        long bal;
+        if (exclusive) {
+            std::unique_lock guard{acct};
+            acct.read(nullptr, 0, &bal);
+            usleep(1);
+        } else {
+            std::shared_lock guard{acct};
+            acct.read(nullptr, 0, &bal);
+            usleep(1);
+        }
+    }
+    opcount = nops;
+}
+
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("i:D:j:J:n:X").set_nthreads(4)
+        .set_noperations(10'000)
+        .set_ndistinguished_threads(1)
+        .parse(argc, argv);
+
+    // Allocate buffer, open files
+    ftx_db* db = ftx_db::open_args(args);
+    args.after_open(db->f, O_RDWR);
+    std::random_device seed_randomness;
+    long expected_total = audit(*db, LOCK_SH);
+    double start_time = monotonic_timestamp();
+
+    // Run transfers and inquiries
+    std::vector<std::thread> th(args.nthreads);
+    std::vector<size_t> opcounts(args.nthreads, 0);
+    for (int i = 0; i != args.nthreads; ++i) {
+        if (i < args.ndistinguished_threads) {
+            th[i] = std::thread(transfer_thread, std::ref(*db),
+                                std::ref(opcounts[i]), seed_randomness());
+        } else {
+            th[i] = std::thread(inquiry_thread, std::ref(*db),
+                                args.noperations, std::ref(opcounts[i]),
+                                args.exclusive, expected_total,
+                                seed_randomness());
+        }
+    }
+
+    // Wait for inquiries, then stop transfers
+    size_t ntransfers = 0, ninquiries = 0;
+    for (int i = args.ndistinguished_threads; i < args.nthreads; ++i) {
+        th[i].join();
+        ninquiries += opcounts[i];
+    }
+    double end_time = monotonic_timestamp();
+    inquiries_done = true;
+    for (int i = 0; i < std::min(args.ndistinguished_threads, args.nthreads); ++i) {
+        th[i].join();
+        ntransfers += opcounts[i];
+    }
+
+    // Flush and close
+    delete db;
+
+    struct rusage usage;
+    int r = getrusage(RUSAGE_SELF, &usage);
+    assert(r == 0);
+    fprintf(stderr, "%d %s, %zu transfers, %zu inquiries (%s locks), %d.%06ds CPU time, %.6fs real time, %.0f inquiries/s\n",
+            args.nthreads, args.nthreads == 1 ? "thread" : "threads",
+            ntransfers, ninquiries, args.exclusive ? "exclusive" : "shared",
+            (int) usage.ru_utime.tv_sec, (int) usage.ru_utime.tv_usec,
+            end_time - start_time,
+            ninquiries / std::max(end_time - start_time, 1e-9));
+}
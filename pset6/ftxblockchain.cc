@@ -1,13 +1,18 @@
 #include "ftxdb.hh"
+#include "ftxledger.hh"
 #include <sys/resource.h>
 #include <thread>
 #include <mutex>
 
-// Usage: ./ftxblockchain [-j NTHREADS] [-n NOPS] [FILE]
+// Usage: ./ftxblockchain [-j NTHREADS] [-n NOPS] [-T] [-S POLICY]
+//                        [-o LEDGER] [FILE]
 //    Perform NOPS * NTHREADS “bank transfers” within FILE, writing
-//    a ledger to LEDGER (defaults to ledger.db).
+//    a ledger to LEDGER (defaults to /tmp/ledger.fdb). Ledger records go
+//    out in group commits (see `ftx_ledger`); POLICY is `buffered`
+//    (default), `flush`, or `fsync`, and under `flush` or `fsync` a
+//    transfer finishes only once its record is committed.
 
-static io61_file* ledgerf;
+static ftx_ledger* ledger;
 
 static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
                             unsigned seed) {
@@ -15,6 +20,7 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
     std::default_random_engine randomness(seed);
     std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
     std::normal_distribution pick_amount(100.0, 10.0);
+    ftx_ledger_buffer* lbuf = ledger->thread_buffer();
 
     size_t i = 0;
     while (i != nops) {
@@ -26,11 +32,11 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
             continue;
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Lock both accounts at once
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        ftx_lockset lockset{&acct1, &acct2};
+        std::unique_lock guard{lockset};
 
         // Read current balances
         char name1[16], name2[16];
@@ -51,14 +57,18 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         acct1.write(bal[0]);
         acct2.write(bal[1]);
 
-        // Write to ledger
+        // Append to ledger while still holding the locks, so the
+        // ledger orders each account's transfers as the locks did
         char report[128];
         size_t n = snprintf(report, sizeof(report),
                             "%-7s %+7ld\n%-7s %+7ld\n",
                             name1, -delta, name2, +delta);
         assert(n == db.asize * 2 && n < sizeof(report));
-        ssize_t np = io61_write(ledgerf, report, n);
-        assert(np == ssize_t(n));
+        uint64_t seq = ledger->append(lbuf, report, n);
+
+        // Wait for the group commit without blocking these accounts
+        guard.unlock();
+        ledger->wait_committed(seq);
 
         ++i;
     }
@@ -68,7 +78,7 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:n:o:S:T").set_nthreads(4)
         .set_noperations(100'000)
         .parse(argc, argv);
 
@@ -78,8 +88,19 @@ int main(int argc, char* argv[]) {
     if (!args.output_file) {
         args.output_file = "/tmp/ledger.fdb";
     }
-    ledgerf = io61_open_check(args.output_file, O_WRONLY | O_CREAT | O_TRUNC);
+    int sync = FTX_LEDGER_BUFFERED;
+    if (args.sync_policy) {
+        sync = ftx_ledger_parse_sync(args.sync_policy);
+        if (sync < 0) {
+            fprintf(stderr, "ftxblockchain: %s: unknown sync policy\n",
+                    args.sync_policy);
+            exit(1);
+        }
+    }
+    io61_file* ledgerf = io61_open_check(args.output_file,
+                                         O_WRONLY | O_CREAT | O_TRUNC);
     args.after_open(ledgerf, O_WRONLY);
+    ledger = new ftx_ledger(ledgerf, sync);
     std::random_device seed_randomness;
     double start_time = monotonic_timestamp();
 
@@ -98,7 +119,8 @@ int main(int argc, char* argv[]) {
         totalops += opcounts[i];
     }
 
-    // Flush and close
+    // Commit, flush, and close
+    delete ledger;
     delete db;
     io61_close(ledgerf);
 
@@ -1,13 +1,63 @@
 #ifndef FTXDB_HH
 #define FTXDB_HH
 #include "io61.hh"
+#include "ftxledger.hh"
+#include <atomic>
+#include <condition_variable>
+#include <initializer_list>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <stdexcept>
+#include <thread>
+#include <unordered_map>
 #include <utility>
 struct ftx_acct;
 
 
+// ftx_memacct
+//    An account in the in-memory table of an `ftx_db` (see
+//    `ftx_db::load_table`). Each account has its own cache line, so
+//    threads updating neighbouring accounts don't fight over lines.
+//    `version` serves `ftx_transfer_optimistic`: it is even while the
+//    balance is stable and odd while a transfer is committing. `owner`
+//    feeds deadlock detection (see `ftx_db::lock_account`).
+
+struct alignas(64) ftx_memacct {
+    std::timed_mutex m;               // the account's lock
+    std::atomic<long> balance = 0;
+    std::atomic<bool> dirty = false;  // changed since the last checkpoint?
+    std::atomic<unsigned> owner = 0;  // `ftx_thread_number` of holder, or 0
+    std::atomic<unsigned long> version = 0;
+};
+
+unsigned ftx_thread_number();
+
+
+// ftx_wal_record
+//    A record in an `ftx_db` write-ahead log. The log is written in
+//    sequence order, so the Nth record has sequence number N. An update
+//    record holds the new balances of the `n` accounts one transfer
+//    changed. A checkpoint record says the database file holds every
+//    update before sequence number `lsn`. `checksum` covers the rest of
+//    the record, so replay can tell where a torn write begins.
+
+enum { FTX_WAL_UPDATE = 1, FTX_WAL_CHECKPOINT = 2 };
+
+struct ftx_wal_record {
+    uint32_t type;
+    uint32_t n;
+    uint64_t lsn;
+    struct {
+        uint64_t aindex;
+        int64_t balance;
+    } u[2];
+    uint64_t checksum;
+
+    uint64_t compute_checksum() const;
+};
+
+
 // ftx_db
 //    Structure representing an open account database.
 
@@ -19,9 +69,44 @@ struct ftx_db {
     size_t balance_size = 7;   // size of balance field within record
     static constexpr size_t max_asize = 512; // maximum asize allowed
 
+    // In-memory mode (`-T`): parsed balances plus the first
+    // `balance_offset` bytes (the name) of every record
+    std::unique_ptr<ftx_memacct[]> table;
+    std::unique_ptr<char[]> prefixes;
+
+    // Wait-for graph for the table's account locks: the account each
+    // blocked thread wants, keyed by `ftx_thread_number`
+    mutable std::mutex waits_m;
+    mutable std::unordered_map<unsigned, size_t> waits;
+
+    // Write-ahead log mode (`-W`, needs the in-memory table): transfers
+    // are logged
+    std::unique_ptr<ftx_ledger> wal;
+    io61_file* walf = nullptr;
+    ftx_ledger_buffer* checkpoint_buf = nullptr;
+
+    // In either in-memory mode, a thread checkpoints the table every
+    // `checkpoint_interval` seconds
+    double checkpoint_interval = 0.1;
+    std::thread checkpointer;
+    std::mutex checkpointer_m;
+    std::condition_variable checkpointer_cv;
+    bool closing = false;
+
     ftx_db(io61_file* f);
     ~ftx_db();
     static ftx_db* open_args(const io61_args& args);
+
+    int load_table();
+    int lock_account(size_t aindex, bool detect) const;
+    void unlock_account(size_t aindex) const;
+    int checkpoint();
+    int open_wal(const char* filename, bool replay, int sync,
+                 double commit_delay);
+    uint64_t log_update(ftx_ledger_buffer* b,
+                        std::initializer_list<const ftx_acct*> accts);
+    void checkpoint_loop();
+    bool would_deadlock(size_t aindex) const;
 };
 
 
@@ -30,13 +115,17 @@ struct ftx_db {
 
 struct ftx_acct {
     const ftx_db& db;
+    size_t aindex;
     off_t offset;
     bool locked = false;
 
     inline ftx_acct(const ftx_db& db, size_t aindex);
 
     inline void lock();
+    inline int lock_or_deadlock();
     inline void unlock();
+    inline void lock_shared();
+    inline void unlock_shared();
     inline int read(char* namebuf, size_t namesz, long* balance) const;
     inline int write(long balance) const;
 
@@ -50,9 +139,27 @@ struct ftx_acct {
 };
 
 
+// ftx_lockset
+//    A set of accounts locked and unlocked together with a single
+//    `io61_lock_many` call, so callers need no lock ordering. Works with
+//    `std::unique_lock`.
+
+struct ftx_lockset {
+    static constexpr size_t max_size = 8;
+    ftx_acct* accts[max_size];
+    io61_range ranges[max_size];
+    size_t n = 0;
+
+    inline ftx_lockset(std::initializer_list<ftx_acct*> accts);
+
+    inline void lock();
+    inline void unlock();
+};
+
+
 // Create an account object for account number `aindex`
-inline ftx_acct::ftx_acct(const ftx_db& db_, size_t aindex)
-    : db(db_) {
+inline ftx_acct::ftx_acct(const ftx_db& db_, size_t aindex_)
+    : db(db_), aindex(aindex_) {
     assert(aindex < this->db.naccounts);
     this->offset = aindex * this->db.asize;
 }
@@ -61,24 +168,149 @@ inline ftx_acct::ftx_acct(const ftx_db& db_, size_t aindex)
 // Lock this account
 inline void ftx_acct::lock() {
     assert(!this->locked);
+    if (this->db.table) {
+        int r = this->db.lock_account(this->aindex, false);
+        assert(r == 0);
+        this->locked = true;
+        return;
+    }
     int r = io61_lock(this->db.f, this->offset, this->db.asize, LOCK_EX);
     assert(r == 0);
     this->locked = true;
 }
 
 
+// Lock this account, unless waiting would deadlock. Returns 0 if the
+// account is now locked and -1 (with `errno == EDEADLK`) if the caller
+// should release its other locks and retry.
+inline int ftx_acct::lock_or_deadlock() {
+    assert(!this->locked);
+    int r;
+    if (this->db.table) {
+        r = this->db.lock_account(this->aindex, true);
+    } else {
+        r = io61_lock(this->db.f, this->offset, this->db.asize, LOCK_EX);
+    }
+    assert(r == 0 || errno == EDEADLK);
+    this->locked = r == 0;
+    return r;
+}
+
+
 // Unlock this account
 inline void ftx_acct::unlock() {
     assert(this->locked);
+    if (this->db.table) {
+        this->db.unlock_account(this->aindex);
+        this->locked = false;
+        return;
+    }
     int r = io61_unlock(this->db.f, this->offset, this->db.asize);
     assert(r == 0);
     this->locked = false;
 }
 
 
+// Lock this account for reading; other readers may hold it too, except
+// in-memory accounts, which have exclusive locks only
+inline void ftx_acct::lock_shared() {
+    if (this->db.table) {
+        this->lock();
+        return;
+    }
+    assert(!this->locked);
+    int r = io61_lock(this->db.f, this->offset, this->db.asize, LOCK_SH);
+    assert(r == 0);
+    this->locked = true;
+}
+
+
+// Release a shared lock on this account
+inline void ftx_acct::unlock_shared() {
+    this->unlock();
+}
+
+
+// Create a lock set for the accounts in `accts_`, which must belong to
+// the same database
+inline ftx_lockset::ftx_lockset(std::initializer_list<ftx_acct*> accts_) {
+    assert(accts_.size() <= max_size);
+    for (ftx_acct* acct : accts_) {
+        assert(acct->db.f == (*accts_.begin())->db.f);
+        this->accts[this->n] = acct;
+        this->ranges[this->n] = {acct->offset, (off_t) acct->db.asize};
+        ++this->n;
+    }
+}
+
+
+// Lock every account in the set
+inline void ftx_lockset::lock() {
+    if (this->n == 0) {
+        return;
+    } else if (this->accts[0]->db.table) {
+        // In-memory accounts have plain mutexes; take them in order
+        ftx_acct* sorted[max_size];
+        for (size_t i = 0; i != this->n; ++i) {
+            sorted[i] = this->accts[i];
+            for (size_t j = i; j != 0 && sorted[j - 1]->aindex > sorted[j]->aindex; --j) {
+                std::swap(sorted[j - 1], sorted[j]);
+            }
+        }
+        for (size_t i = 0; i != this->n; ++i) {
+            sorted[i]->lock();
+        }
+        return;
+    }
+    int r = io61_lock_many(this->accts[0]->db.f, this->ranges, this->n,
+                           LOCK_EX);
+    assert(r == 0);
+    for (size_t i = 0; i != this->n; ++i) {
+        assert(!this->accts[i]->locked);
+        this->accts[i]->locked = true;
+    }
+}
+
+
+// Unlock every account in the set
+inline void ftx_lockset::unlock() {
+    if (this->n == 0) {
+        return;
+    } else if (this->accts[0]->db.table) {
+        for (size_t i = 0; i != this->n; ++i) {
+            this->accts[i]->unlock();
+        }
+        return;
+    }
+    for (size_t i = 0; i != this->n; ++i) {
+        assert(this->accts[i]->locked);
+        this->accts[i]->locked = false;
+    }
+    int r = io61_unlock_many(this->accts[0]->db.f, this->ranges, this->n);
+    assert(r == 0);
+}
+
+
 // Read this account’s current name and/or balance, storing the name
 // in `namebuf[0..namesz-1]` and the balance in `*balance`
 inline int ftx_acct::read(char* namebuf, size_t namesz, long* balance) const {
+    if (this->db.table) {
+        if (namebuf && namesz > 0) {
+            const char* name = &this->db.prefixes[this->aindex * this->db.balance_offset];
+            size_t off = 0;
+            while (off != namesz - 1 && off != this->db.balance_offset
+                   && name[off] != ' ') {
+                namebuf[off] = name[off];
+                ++off;
+            }
+            namebuf[off] = '\0';
+        }
+        if (balance) {
+            *balance = this->db.table[this->aindex].balance.load(std::memory_order_relaxed);
+        }
+        return 0;
+    }
+
     // Read account from file; short reads are errors
     char buf[ftx_db::max_asize];
     ssize_t nr = io61_pread(this->db.f, buf, this->db.asize, this->offset);
@@ -93,6 +325,14 @@ inline int ftx_acct::read(char* namebuf, size_t namesz, long* balance) const {
 
 // Write `balance` to the account database as this account’s new balance
 inline int ftx_acct::write(long balance) const {
+    // In-memory accounts reach the file at the next checkpoint
+    if (this->db.table) {
+        ftx_memacct& ma = this->db.table[this->aindex];
+        ma.balance.store(balance, std::memory_order_relaxed);
+        ma.dirty.store(true, std::memory_order_release);
+        return 0;
+    }
+
     // Stringify balance to stack buffer
     char buf[ftx_db::max_asize];
     auto [ptr, len] = unparse(buf, sizeof(buf), this->db, balance);
@@ -111,4 +351,62 @@ inline int ftx_acct::write(long balance) const {
     }
 }
 
+
+// ftx_transfer_optimistic(db, aindex, compute)
+//    Transfers money between in-memory accounts `aindex[0]` and
+//    `aindex[1]` without taking locks. Reads both balances and their
+//    versions, then calls `compute(bal)` to update `bal[0]` and `bal[1]`.
+//    The commit claims both versions in account order by compare-and-swap,
+//    which fails if either account changed since the read; then it stores
+//    the new balances and publishes the next even versions. A failed commit
+//    reruns the whole transfer. Returns the number of reruns.
+//
+//    `compute` may run several times and should have no side effects
+//    beyond `bal`. Accounts changed this way must not also be locked with
+//    `ftx_acct::lock`.
+
+template <typename F>
+size_t ftx_transfer_optimistic(ftx_db& db, const size_t aindex[2],
+                               F compute) {
+    assert(db.table && aindex[0] != aindex[1]);
+    ftx_memacct* ma[2] = {&db.table[aindex[0]], &db.table[aindex[1]]};
+    int first = aindex[0] < aindex[1] ? 0 : 1;
+
+    for (size_t nretries = 0; true; ++nretries) {
+        // Snapshot balances, skipping accounts in mid-commit
+        unsigned long v[2];
+        long bal[2];
+        for (int i = 0; i != 2; ++i) {
+            while ((v[i] = ma[i]->version.load(std::memory_order_acquire)) & 1) {
+                std::this_thread::yield();
+            }
+            bal[i] = ma[i]->balance.load(std::memory_order_relaxed);
+        }
+
+        compute(bal);
+
+        // Claim both versions; either claim fails if that account changed
+        // (a balance read above that raced with a commit fails here too)
+        unsigned long expected = v[first];
+        if (!ma[first]->version.compare_exchange_strong(
+                expected, v[first] + 1, std::memory_order_acquire)) {
+            continue;
+        }
+        expected = v[1 - first];
+        if (!ma[1 - first]->version.compare_exchange_strong(
+                expected, v[1 - first] + 1, std::memory_order_acquire)) {
+            // Nothing was written, so the old version is still accurate
+            ma[first]->version.store(v[first], std::memory_order_release);
+            continue;
+        }
+
+        for (int i = 0; i != 2; ++i) {
+            ma[i]->balance.store(bal[i], std::memory_order_relaxed);
+            ma[i]->dirty.store(true, std::memory_order_release);
+            ma[i]->version.store(v[i] + 2, std::memory_order_release);
+        }
+        return nretries;
+    }
+}
+
 #endif
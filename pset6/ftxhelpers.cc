@@ -1,5 +1,7 @@
 #include "ftxdb.hh"
 #include <charconv>
+#include <chrono>
+#include <cstddef>
 #include <cstdlib>
 
 ftx_db::ftx_db(io61_file* f_) {
@@ -18,10 +20,364 @@ ftx_db::ftx_db(io61_file* f_) {
 }
 
 ftx_db::~ftx_db() {
+    if (this->checkpointer.joinable()) {
+        {
+            std::unique_lock guard(this->checkpointer_m);
+            this->closing = true;
+        }
+        this->checkpointer_cv.notify_all();
+        this->checkpointer.join();
+    }
+    int r = this->checkpoint();
+    assert(r == 0);
+    if (this->wal) {
+        this->wal.reset();
+        io61_close(this->walf);
+    }
     io61_close(this->f);
 }
 
 
+// ftx_db::load_table()
+//    Switches this database to in-memory mode: parses every record into
+//    a table of binary balances with per-account locks. From then on,
+//    `ftx_acct` reads and writes touch only the table, and `checkpoint`
+//    (called periodically and on close) writes changed records back to
+//    the file.
+//    Returns 0 on success and -1 on error.
+
+int ftx_db::load_table() {
+    assert(!this->table);
+    assert(this->asize == this->balance_offset + this->balance_size + 1);
+    std::unique_ptr<ftx_memacct[]> tab(new ftx_memacct[this->naccounts]);
+    std::unique_ptr<char[]> pre(new char[this->naccounts * this->balance_offset]);
+
+    size_t chunk = 4096;
+    std::unique_ptr<char[]> buf(new char[chunk * this->asize]);
+    for (size_t a = 0; a < this->naccounts; a += chunk) {
+        size_t n = std::min(chunk, this->naccounts - a);
+        ssize_t nr = io61_pread(this->f, buf.get(), n * this->asize,
+                                a * this->asize);
+        if (nr != ssize_t(n * this->asize)) {
+            errno = EINVAL;
+            return -1;
+        }
+        for (size_t i = 0; i != n; ++i) {
+            const char* rec = &buf[i * this->asize];
+            long balance;
+            if (ftx_acct::parse(rec, this->asize, *this, nullptr, 0,
+                                &balance) == -1) {
+                return -1;
+            }
+            tab[a + i].balance = balance;
+            memcpy(&pre[(a + i) * this->balance_offset], rec,
+                   this->balance_offset);
+        }
+    }
+
+    this->table = std::move(tab);
+    this->prefixes = std::move(pre);
+    return 0;
+}
+
+
+// ftx_thread_number()
+//    Returns a small nonzero number naming the calling thread, for the
+//    table's lock owners and wait-for graph.
+
+unsigned ftx_thread_number() {
+    static std::atomic<unsigned> next = 1;
+    static thread_local unsigned me = next++;
+    return me;
+}
+
+
+// ftx_db::lock_account(aindex, detect)
+//    Locks in-memory account `aindex`. A thread that must wait records
+//    the account it wants in `waits`. If `detect` is true, it gives up
+//    with -1 and `errno == EDEADLK` when the wait-for graph shows a cycle
+//    through it: the account's holder waits, directly or indirectly, for
+//    a lock this thread holds. Cycles that other threads close later are
+//    caught by checking again every millisecond. Otherwise returns 0.
+
+int ftx_db::lock_account(size_t aindex, bool detect) const {
+    ftx_memacct& a = this->table[aindex];
+    unsigned me = ftx_thread_number();
+    if (!a.m.try_lock()) {
+        std::unique_lock guard(this->waits_m);
+        this->waits[me] = aindex;
+        while (true) {
+            if (detect && this->would_deadlock(aindex)) {
+                this->waits.erase(me);
+                errno = EDEADLK;
+                return -1;
+            }
+            guard.unlock();
+            // (`try_lock_for` would use a clock sanitizers don't intercept)
+            auto deadline = std::chrono::system_clock::now()
+                + std::chrono::milliseconds(1);
+            bool acquired = a.m.try_lock_until(deadline);
+            guard.lock();
+            if (acquired) {
+                break;
+            }
+        }
+        this->waits.erase(me);
+    }
+    a.owner.store(me, std::memory_order_relaxed);
+    return 0;
+}
+
+
+// ftx_db::unlock_account(aindex)
+//    Unlocks in-memory account `aindex`.
+
+void ftx_db::unlock_account(size_t aindex) const {
+    ftx_memacct& a = this->table[aindex];
+    a.owner.store(0, std::memory_order_relaxed);
+    a.m.unlock();
+}
+
+
+// ftx_db::would_deadlock(aindex)
+//    Returns true if the calling thread, about to wait for account
+//    `aindex`, would close a cycle in the wait-for graph. Requires
+//    `waits_m`.
+
+bool ftx_db::would_deadlock(size_t aindex) const {
+    unsigned me = ftx_thread_number();
+    // Each blocked thread waits for one account, so follow the chain;
+    // it can be no longer than the number of waiting threads
+    for (size_t n = 0; n <= this->waits.size(); ++n) {
+        unsigned holder = this->table[aindex].owner.load(std::memory_order_relaxed);
+        if (holder == me) {
+            return true;
+        }
+        auto it = this->waits.find(holder);
+        if (holder == 0 || it == this->waits.end()) {
+            return false;
+        }
+        aindex = it->second;
+    }
+    return false;
+}
+
+
+// ftx_db::checkpoint()
+//    Writes the in-memory accounts changed since the last checkpoint back
+//    to the file, then flushes it. Runs of adjacent changed records go
+//    out in one `io61_pwrite`. Returns 0 on success and -1 on error.
+//
+//    Without a write-ahead log, each record written reflects a single
+//    balance, but only a quiescent database (no transfers in progress)
+//    is guaranteed to be checkpointed as a consistent whole. With a log,
+//    the changed balances are collected under every account lock, so
+//    they match a log position; the log is made durable through that
+//    position before the file changes, and the file is synced before a
+//    checkpoint record tells replay it can skip the earlier updates.
+//    Checkpoints must not run concurrently.
+
+int ftx_db::checkpoint() {
+    if (!this->table) {
+        return io61_flush(this->f);
+    }
+
+    // Collect changed accounts
+    std::vector<std::pair<size_t, long>> changed;
+    uint64_t lsn = 0;
+    if (this->wal) {
+        for (size_t a = 0; a != this->naccounts; ++a) {
+            this->lock_account(a, false);
+        }
+    }
+    for (size_t a = 0; a != this->naccounts; ++a) {
+        if (this->table[a].dirty.exchange(false, std::memory_order_acquire)) {
+            changed.push_back({
+                a, this->table[a].balance.load(std::memory_order_relaxed)
+            });
+        }
+    }
+    if (this->wal) {
+        lsn = this->wal->next_seq;
+        for (size_t a = 0; a != this->naccounts; ++a) {
+            this->unlock_account(a);
+        }
+        if (lsn != 0 && this->wal->make_durable(lsn - 1) == -1) {
+            return -1;
+        }
+    }
+
+    size_t batch = 256;
+    std::unique_ptr<char[]> buf(new char[batch * this->asize]);
+    size_t i = 0;
+    while (i != changed.size()) {
+        // Format a run of changed records
+        size_t first = changed[i].first, n = 0;
+        do {
+            size_t a = changed[i].first;
+            char* rec = &buf[n * this->asize];
+            memcpy(rec, &this->prefixes[a * this->balance_offset],
+                   this->balance_offset);
+            char tmp[ftx_db::max_asize];
+            auto [ptr, len] = ftx_acct::unparse(tmp, sizeof(tmp), *this,
+                                                changed[i].second);
+            if (len != this->asize - this->balance_offset) {
+                errno = EINVAL;
+                return -1;
+            }
+            memcpy(rec + this->balance_offset, ptr, len);
+            ++n;
+            ++i;
+        } while (i != changed.size() && n != batch
+                 && changed[i].first == first + n);
+
+        ssize_t nw = io61_pwrite(this->f, buf.get(), n * this->asize,
+                                 first * this->asize);
+        if (nw != ssize_t(n * this->asize)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    if (io61_flush(this->f) == -1) {
+        return -1;
+    }
+
+    if (this->wal) {
+        if (fsync(io61_fileno(this->f)) == -1) {
+            return -1;
+        }
+        ftx_wal_record rec = {};
+        rec.type = FTX_WAL_CHECKPOINT;
+        rec.lsn = lsn;
+        rec.checksum = rec.compute_checksum();
+        this->wal->append(this->checkpoint_buf, (const char*) &rec,
+                          sizeof(rec));
+    }
+    return 0;
+}
+
+
+// ftx_db::checkpoint_loop()
+//    The checkpoint thread, started by `open_wal` or, for an in-memory
+//    table without a log, by `open_args`.
+
+void ftx_db::checkpoint_loop() {
+    auto interval = std::chrono::duration<double>(this->checkpoint_interval);
+    std::unique_lock guard(this->checkpointer_m);
+    while (!this->checkpointer_cv.wait_for(guard, interval, [&] {
+                return this->closing;
+            })) {
+        guard.unlock();
+        int r = this->checkpoint();
+        assert(r == 0);
+        guard.lock();
+    }
+}
+
+
+// ftx_wal_record::compute_checksum()
+//    Returns the FNV-1a hash of every byte before `checksum`.
+
+uint64_t ftx_wal_record::compute_checksum() const {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(this);
+    uint64_t h = 14695981039346656037UL;
+    for (size_t i = 0; i != offsetof(ftx_wal_record, checksum); ++i) {
+        h = (h ^ p[i]) * 1099511628211UL;
+    }
+    return h;
+}
+
+
+// ftx_db::open_wal(filename, replay, sync, commit_delay)
+//    Starts logging transfers to write-ahead log `filename` (see
+//    `ftx_ledger` for `sync` and `commit_delay`) and starts the
+//    checkpoint thread. If `replay` is true, first applies the updates
+//    in any existing log that the last complete checkpoint doesn't
+//    cover, stopping at the first torn record, and saves the result;
+//    otherwise an existing log is discarded. Needs the in-memory table.
+//    Returns 0 on success and -1 on error.
+
+int ftx_db::open_wal(const char* filename, bool replay, int sync,
+                     double commit_delay) {
+    assert(this->table && !this->wal);
+    int fd = replay ? open(filename, O_RDONLY) : -1;
+    if (fd == -1 && replay && errno != ENOENT) {
+        return -1;
+    } else if (fd != -1) {
+        // Read every intact record
+        io61_file* rf = io61_fdopen(fd, O_RDONLY);
+        std::vector<ftx_wal_record> recs;
+        ftx_wal_record rec;
+        while (io61_read(rf, (unsigned char*) &rec, sizeof(rec)) == ssize_t(sizeof(rec))
+               && rec.checksum == rec.compute_checksum()) {
+            recs.push_back(rec);
+        }
+        io61_close(rf);
+
+        // Apply updates from the last checkpoint on
+        uint64_t start = 0;
+        for (auto& r : recs) {
+            if (r.type == FTX_WAL_CHECKPOINT) {
+                start = r.lsn;
+            }
+        }
+        size_t nreplayed = 0;
+        for (size_t i = start; i < recs.size(); ++i) {
+            if (recs[i].type != FTX_WAL_UPDATE) {
+                continue;
+            }
+            for (uint32_t j = 0; j != recs[i].n && j != 2; ++j) {
+                if (recs[i].u[j].aindex >= this->naccounts) {
+                    errno = EINVAL;
+                    return -1;
+                }
+                ftx_memacct& ma = this->table[recs[i].u[j].aindex];
+                ma.balance = recs[i].u[j].balance;
+                ma.dirty = true;
+            }
+            ++nreplayed;
+        }
+        if (nreplayed != 0) {
+            fprintf(stderr, "%s: replayed %zu updates\n", filename, nreplayed);
+        }
+
+        // Save the result before the log is reset
+        if (this->checkpoint() == -1 || fsync(io61_fileno(this->f)) == -1) {
+            return -1;
+        }
+    }
+
+    this->walf = io61_open_check(filename, O_WRONLY | O_CREAT | O_TRUNC);
+    this->wal.reset(new ftx_ledger(this->walf, sync, 0.001, commit_delay));
+    this->checkpoint_buf = this->wal->thread_buffer();
+    this->checkpointer = std::thread(&ftx_db::checkpoint_loop, this);
+    return 0;
+}
+
+
+// ftx_db::log_update(b, accts)
+//    Appends an update record with the current balances of `accts` to
+//    the write-ahead log via the caller's buffer `b`, and returns its
+//    sequence number. Call it after writing the balances and before
+//    unlocking the accounts.
+
+uint64_t ftx_db::log_update(ftx_ledger_buffer* b,
+                            std::initializer_list<const ftx_acct*> accts) {
+    assert(this->wal && accts.size() <= 2);
+    ftx_wal_record rec = {};
+    rec.type = FTX_WAL_UPDATE;
+    for (const ftx_acct* acct : accts) {
+        assert(acct->locked);
+        rec.u[rec.n].aindex = acct->aindex;
+        rec.u[rec.n].balance =
+            this->table[acct->aindex].balance.load(std::memory_order_relaxed);
+        ++rec.n;
+    }
+    rec.checksum = rec.compute_checksum();
+    return this->wal->append(b, (const char*) &rec, sizeof(rec));
+}
+
+
 ftx_db* ftx_db::open_args(const io61_args& args) {
     const char* original = args.input_file;
     if (original == nullptr) {
@@ -48,7 +404,29 @@ ftx_db* ftx_db::open_args(const io61_args& args) {
         assert(r == 0);
     }
     io61_file* f = io61_open_check(copy, O_RDWR);
-    return new ftx_db(f);
+    ftx_db* db = new ftx_db(f);
+    if ((args.memtable || args.wal_file) && db->load_table() == -1) {
+        fprintf(stderr, "%s: cannot load accounts into memory\n", copy);
+        exit(1);
+    }
+    if (args.wal_file) {
+        int sync = FTX_LEDGER_BUFFERED;
+        if (args.sync_policy
+            && (sync = ftx_ledger_parse_sync(args.sync_policy)) < 0) {
+            fprintf(stderr, "%s: unknown sync policy\n", args.sync_policy);
+            exit(1);
+        }
+        // A fresh copy starts a fresh log; only replay into the original
+        if (db->open_wal(args.wal_file, strcmp(original, copy) == 0, sync,
+                         args.commit_delay / 1e6) == -1) {
+            fprintf(stderr, "%s: %s\n", args.wal_file, strerror(errno));
+            exit(1);
+        }
+    } else if (db->table) {
+        // Without a log, checkpoints still bound how stale the file gets
+        db->checkpointer = std::thread(&ftx_db::checkpoint_loop, db);
+    }
+    return db;
 }
 
 
@@ -0,0 +1,236 @@
+#include "ftxledger.hh"
+#include <chrono>
+#include <functional>
+#include <queue>
+
+// ftx_ledger_parse_sync(name)
+//    Returns the sync policy called `name` (`buffered`, `flush`, or
+//    `fsync`), or -1 if there is none.
+
+int ftx_ledger_parse_sync(const char* name) {
+    if (strcmp(name, "buffered") == 0) {
+        return FTX_LEDGER_BUFFERED;
+    } else if (strcmp(name, "flush") == 0) {
+        return FTX_LEDGER_FLUSH;
+    } else if (strcmp(name, "fsync") == 0) {
+        return FTX_LEDGER_FSYNC;
+    } else {
+        return -1;
+    }
+}
+
+
+// ftx_ledger::ftx_ledger(f, sync, interval, commit_delay)
+//    Starts a ledger that appends to `f` with sync policy `sync`. The
+//    writer commits `commit_delay` seconds after a thread starts waiting
+//    in `wait_committed`, so that other threads can join the group, and
+//    at least every `interval` seconds otherwise.
+
+ftx_ledger::ftx_ledger(io61_file* f_, int sync_, double interval_,
+                       double commit_delay_)
+    : f(f_), sync(sync_), interval(interval_),
+      commit_delay(commit_delay_) {
+    assert(sync_ >= FTX_LEDGER_BUFFERED && sync_ <= FTX_LEDGER_FSYNC);
+    this->writer = std::thread(&ftx_ledger::writer_loop, this);
+}
+
+ftx_ledger::~ftx_ledger() {
+    {
+        std::unique_lock guard(this->m);
+        this->stopping = true;
+    }
+    this->writer_cv.notify_all();
+    this->writer.join();
+    const char* stats_env = getenv("IO61_STATS");
+    if (stats_env && *stats_env && strcmp(stats_env, "0") != 0) {
+        fprintf(stderr, "ledger fd %d: %lu records, %zu group commits\n",
+                io61_fileno(this->f), (unsigned long) this->committed_seq,
+                this->ncommits);
+    }
+}
+
+
+// ftx_ledger::thread_buffer()
+//    Returns a new append buffer for the calling thread. Buffers live as
+//    long as the ledger.
+
+ftx_ledger_buffer* ftx_ledger::thread_buffer() {
+    std::unique_lock guard(this->m);
+    this->buffers.emplace_back();
+    return &this->buffers.back();
+}
+
+
+// ftx_ledger::append(b, data, len)
+//    Appends the record `data[0..len-1]` to buffer `b`, which belongs to
+//    the calling thread, and returns its sequence number. Records reach
+//    the file in sequence number order.
+
+uint64_t ftx_ledger::append(ftx_ledger_buffer* b, const char* data,
+                            size_t len) {
+    std::unique_lock guard(b->m);
+    uint64_t seq = this->next_seq++;
+    b->recs.push_back({seq, len});
+    b->data.append(data, len);
+    return seq;
+}
+
+
+// ftx_ledger::wait_locked(guard, seq)
+//   Waits for the writer to commit record `seq`. `guard` holds `m`.
+
+void ftx_ledger::wait_locked(std::unique_lock<std::mutex>& guard,
+                             uint64_t seq) {
+    if (this->committed_seq > seq) {
+        return;
+    }
+    if (this->wanted_seq <= seq) {
+        this->wanted_seq = seq + 1;
+        this->writer_cv.notify_one();
+    }
+    while (this->committed_seq <= seq) {
+        this->commit_cv.wait(guard);
+    }
+}
+
+
+// ftx_ledger::wait_committed(seq)
+//    Blocks until record `seq` and all records before it have been
+//    committed under the ledger's sync policy. Buffered ledgers make no
+//    promise, so this returns at once.
+
+void ftx_ledger::wait_committed(uint64_t seq) {
+    if (this->sync == FTX_LEDGER_BUFFERED) {
+        return;
+    }
+    std::unique_lock guard(this->m);
+    this->wait_locked(guard, seq);
+}
+
+
+// ftx_ledger::make_durable(seq)
+//    Blocks until record `seq` and all records before it are on disk,
+//    whatever the sync policy. Returns 0 on success and -1 on error.
+
+int ftx_ledger::make_durable(uint64_t seq) {
+    {
+        std::unique_lock guard(this->m);
+        this->wait_locked(guard, seq);
+    }
+    if (this->sync == FTX_LEDGER_FSYNC) {
+        return 0;
+    } else if (io61_flush(this->f) == -1) {
+        return -1;
+    }
+    return fsync(io61_fileno(this->f));
+}
+
+
+// ftx_ledger::gather(out, seq)
+//   Moves new records from every thread buffer to the writer's side, then
+//   appends records to `out`, in order, for as long as they continue
+//   sequence number `seq`, advancing `seq`. A record whose predecessor is
+//   still being appended waits for the next call. Returns true if no
+//   records are left over. Called by the writer with `m` held.
+
+bool ftx_ledger::gather(std::string& out, uint64_t& seq) {
+    using head = std::pair<uint64_t, ftx_ledger_buffer*>;
+    std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+
+    for (auto& b : this->buffers) {
+        {
+            std::unique_lock guard(b.m);
+            if (b.wpos == b.wrecs.size()) {
+                // Everything taken before is written; swap in new records
+                b.wrecs.clear();
+                b.wdata.clear();
+                b.wpos = b.woff = 0;
+                std::swap(b.recs, b.wrecs);
+                std::swap(b.data, b.wdata);
+            } else if (!b.recs.empty()) {
+                b.wrecs.insert(b.wrecs.end(), b.recs.begin(), b.recs.end());
+                b.wdata += b.data;
+                b.recs.clear();
+                b.data.clear();
+            }
+        }
+        if (b.wpos != b.wrecs.size()) {
+            heads.push({b.wrecs[b.wpos].seq, &b});
+        }
+    }
+
+    // Merge the buffers, which are each in sequence order
+    while (!heads.empty() && heads.top().first == seq) {
+        ftx_ledger_buffer* b = heads.top().second;
+        heads.pop();
+        size_t len = b->wrecs[b->wpos].len;
+        out.append(b->wdata, b->woff, len);
+        b->woff += len;
+        ++b->wpos;
+        ++seq;
+        if (b->wpos != b->wrecs.size()) {
+            heads.push({b->wrecs[b->wpos].seq, b});
+        }
+    }
+    return heads.empty();
+}
+
+
+// ftx_ledger::writer_loop()
+//   The writer thread. Each round gathers the records that are ready and
+//   commits them as one group: a single `io61_write`, then a flush or
+//   `fsync` as the sync policy requires.
+
+void ftx_ledger::writer_loop() {
+    std::string out;
+    uint64_t seq = 0;
+    auto timeout = std::chrono::duration<double>(this->interval);
+    auto delay = std::chrono::duration<double>(this->commit_delay);
+    std::unique_lock guard(this->m);
+    while (true) {
+        this->writer_cv.wait_for(guard, timeout, [&] {
+            return this->stopping || this->committed_seq < this->wanted_seq;
+        });
+        if (this->commit_delay > 0 && !this->stopping
+            && this->committed_seq < this->wanted_seq) {
+            // Give other threads time to join this group
+            this->writer_cv.wait_for(guard, delay, [&] {
+                return this->stopping;
+            });
+        }
+        bool stop = this->stopping;
+        out.clear();
+        bool drained = this->gather(out, seq);
+        if (out.empty()) {
+            if (stop && drained) {
+                return;
+            } else if (!drained) {
+                // A record is still being appended; let its thread finish
+                guard.unlock();
+                std::this_thread::yield();
+                guard.lock();
+            }
+            continue;
+        }
+        guard.unlock();
+
+        ssize_t nw = io61_write(this->f, out.data(), out.size());
+        assert(nw == ssize_t(out.size()));
+        if (this->sync != FTX_LEDGER_BUFFERED) {
+            int r = io61_flush(this->f);
+            assert(r == 0);
+        }
+        if (this->sync == FTX_LEDGER_FSYNC) {
+            int r = fsync(io61_fileno(this->f));
+            assert(r == 0);
+        }
+
+        guard.lock();
+        this->committed_seq = seq;
+        ++this->ncommits;
+        this->commit_cv.notify_all();
+        if (stop && drained) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef FTXLEDGER_HH
+#define FTXLEDGER_HH
+#include "io61.hh"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+
+// Sync policies for `ftx_ledger`: what a group commit does after writing
+enum {
+    FTX_LEDGER_BUFFERED,   // nothing; the io61 cache drains on its own
+    FTX_LEDGER_FLUSH,      // flush the io61 cache to the kernel
+    FTX_LEDGER_FSYNC       // flush, then `fsync` the file
+};
+int ftx_ledger_parse_sync(const char* name);
+
+
+// ftx_ledger_buffer
+//    One thread's ledger records awaiting a group commit, tagged with
+//    their commit sequence numbers. Appenders fill `recs` and `data`
+//    under `m`; the writer moves them to `wrecs` and `wdata`, which only
+//    it touches.
+
+struct ftx_ledger_buffer {
+    struct record {
+        uint64_t seq;
+        size_t len;
+    };
+
+    std::mutex m;
+    std::vector<record> recs;
+    std::string data;
+
+    std::vector<record> wrecs;
+    std::string wdata;
+    size_t wpos = 0;           // next unwritten record in `wrecs`
+    size_t woff = 0;           // its offset in `wdata`
+};
+
+
+// ftx_ledger
+//    A ledger file written by group commit. Threads append records to
+//    private buffers; a dedicated writer thread gathers them in sequence
+//    order and writes each batch with one `io61_write`.
+//
+//    Every record gets its sequence number inside `append`, so a caller
+//    that appends while holding the locks on the accounts it changed
+//    gets the same order in the ledger as in the locks. Destroying the
+//    ledger commits every record appended so far; it does not close `f`.
+//    With `IO61_STATS` set, it also reports the group commit count.
+
+struct ftx_ledger {
+    ftx_ledger(io61_file* f, int sync = FTX_LEDGER_BUFFERED,
+               double interval = 0.001, double commit_delay = 0);
+    ~ftx_ledger();
+
+    ftx_ledger_buffer* thread_buffer();
+    uint64_t append(ftx_ledger_buffer* b, const char* data, size_t len);
+    void wait_committed(uint64_t seq);
+    int make_durable(uint64_t seq);
+
+    io61_file* f;
+    int sync;
+    double interval;           // longest wait between group commits
+    double commit_delay;       // how long a waiter lets a group gather
+
+    std::atomic<uint64_t> next_seq = 0;
+
+    std::mutex m;              // protects fields below
+    std::condition_variable writer_cv;
+    std::condition_variable commit_cv;
+    std::list<ftx_ledger_buffer> buffers;
+    uint64_t committed_seq = 0;  // records before this are committed
+    uint64_t wanted_seq = 0;   // a thread waits for records before this
+    size_t ncommits = 0;       // group commits that wrote something
+    bool stopping = false;
+
+    std::thread writer;
+
+    void wait_locked(std::unique_lock<std::mutex>& guard, uint64_t seq);
+    void writer_loop();
+    bool gather(std::string& out, uint64_t& seq);
+};
+
+#endif
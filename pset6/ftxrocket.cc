@@ -1,14 +1,40 @@
 #include "ftxdb.hh"
 #include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
 #include <thread>
 #include <mutex>
 
-// Usage: ./ftxrocket [-j NTHREADS] [-n NOPS] [FILE]
+// Usage: ./ftxrocket [-j NTHREADS] [-J NSBFTHREADS] [-n NOPS] [-T] [FILE]
 //    Perform NOPS * NTHREADS “bank transfers” within FILE, completely
-//    legally.
+//    legally. Transfers lock accounts in no particular order and rely on
+//    `io61_lock` (with `-T`, the table's wait-for graph) to report
+//    deadlocks. The first NSBFTHREADS threads (default 1) mostly move
+//    money among the three hot accounts 0-2. At the end, prints transfer
+//    latency percentiles for each class of thread. Run with
+//    `IO61_LOCKPOLICY=fifo` or `=priority` to compare lock policies;
+//    under `priority`, ordinary transfers go first.
+
+static std::atomic<size_t> ndeadlocks = 0;
+
+// Lock `acct1`, then `acct2`. If waiting for `acct2` would deadlock,
+// release `acct1` and try again.
+static void lock_both(ftx_acct& acct1, ftx_acct& acct2) {
+    while (true) {
+        acct1.lock();
+        if (acct2.lock_or_deadlock() == 0) {
+            return;
+        }
+        acct1.unlock();
+        ++ndeadlocks;
+        std::this_thread::yield();
+    }
+}
 
 static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
-                            unsigned seed) {
+                            std::vector<double>& latencies, unsigned seed) {
+    io61_set_lock_priority(1);
+
     // Obtain a source of random account numbers
     std::default_random_engine randomness(seed);
     std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
@@ -24,11 +50,14 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
             continue;
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Lock both accounts in the order picked; if that would deadlock,
+        // back off and retry
+        double start_time = monotonic_timestamp();
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        lock_both(acct1, acct2);
+        std::unique_lock guard1{acct1, std::adopt_lock};
+        std::unique_lock guard2{acct2, std::adopt_lock};
 
         // Read current balances
         long bal[2];
@@ -47,6 +76,9 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         // Update balances
         acct1.write(bal[0]);
         acct2.write(bal[1]);
+        guard2.unlock();
+        guard1.unlock();
+        latencies.push_back(monotonic_timestamp() - start_time);
 
         ++i;
     }
@@ -55,6 +87,7 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
 
 static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
+                                std::vector<double>& latencies,
                                 unsigned seed) {
     // Obtain a source of random account numbers
     std::default_random_engine randomness(seed);
@@ -81,11 +114,14 @@ static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
             aindex[1] = pick_sbf_account(randomness);
         }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Lock both accounts in the order picked; if that would deadlock,
+        // back off and retry
+        double start_time = monotonic_timestamp();
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        lock_both(acct1, acct2);
+        std::unique_lock guard1{acct1, std::adopt_lock};
+        std::unique_lock guard2{acct2, std::adopt_lock};
 
         // Read current balances
         long bal[2];
@@ -104,6 +140,9 @@ static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         // Update balances
         acct1.write(bal[0]);
         acct2.write(bal[1]);
+        guard2.unlock();
+        guard1.unlock();
+        latencies.push_back(monotonic_timestamp() - start_time);
 
         ++i;
     }
@@ -111,9 +150,30 @@ static void sbf_transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 }
 
 
+// Print latency percentiles for the transfers in `latencies[first, last)`
+static void report_latencies(const char* name,
+                             std::vector<std::vector<double>>& latencies,
+                             int first, int last) {
+    std::vector<double> all;
+    for (int i = first; i < last; ++i) {
+        all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+    }
+    if (all.empty()) {
+        return;
+    }
+    std::sort(all.begin(), all.end());
+    auto pct = [&] (double p) {
+        return all[std::min(all.size() - 1, size_t(p * all.size()))] * 1e6;
+    };
+    fprintf(stderr, "%s: %zu transfers, latency p50 %.0fus, p99 %.0fus, "
+            "p99.9 %.0fus, max %.0fus\n", name, all.size(),
+            pct(0.5), pct(0.99), pct(0.999), all.back() * 1e6);
+}
+
+
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:J:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:J:n:T").set_nthreads(4)
         .set_noperations(100'000)
         .set_ndistinguished_threads(1)
         .parse(argc, argv);
@@ -127,15 +187,19 @@ int main(int argc, char* argv[]) {
     // Run transfers
     std::vector<std::thread> th(args.nthreads);
     std::vector<size_t> opcounts(args.nthreads, 0);
+    std::vector<std::vector<double>> latencies(args.nthreads);
+    for (auto& l : latencies) {
+        l.reserve(args.noperations);
+    }
     for (int i = 0; i != args.nthreads; ++i) {
         if (i < args.ndistinguished_threads) {
             th[i] = std::thread(sbf_transfer_thread, std::ref(*db),
                                 args.noperations, std::ref(opcounts[i]),
-                                seed_randomness());
+                                std::ref(latencies[i]), seed_randomness());
         } else {
             th[i] = std::thread(transfer_thread, std::ref(*db),
                                 args.noperations, std::ref(opcounts[i]),
-                                seed_randomness());
+                                std::ref(latencies[i]), seed_randomness());
         }
     }
 
@@ -152,9 +216,13 @@ int main(int argc, char* argv[]) {
     struct rusage usage;
     int r = getrusage(RUSAGE_SELF, &usage);
     assert(r == 0);
-    fprintf(stderr, "%d %s, %zu %s, %d.%06ds CPU time, %.6fs real time\n",
+    fprintf(stderr, "%d %s, %zu %s, %zu %s, %d.%06ds CPU time, %.6fs real time\n",
             args.nthreads, args.nthreads == 1 ? "thread" : "threads",
             totalops, totalops == 1 ? "operation" : "operations",
+            ndeadlocks.load(), ndeadlocks == 1 ? "deadlock" : "deadlocks",
             (int) usage.ru_utime.tv_sec, (int) usage.ru_utime.tv_usec,
             end_time - start_time);
+    int nsbf = std::min(args.ndistinguished_threads, args.nthreads);
+    report_latencies("sbf threads", latencies, 0, nsbf);
+    report_latencies("other threads", latencies, nsbf, args.nthreads);
 }
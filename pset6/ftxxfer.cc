@@ -3,17 +3,43 @@
 #include <thread>
 #include <mutex>
 
-// Usage: ./ftxxfer [-j NTHREADS] [-n NOPS] [FILE]
-//    Perform NOPS * NTHREADS “bank transfers” within FILE.
+// Usage: ./ftxxfer [-j NTHREADS] [-n NOPS] [-T] [-C]
+//                  [-W WAL [-S POLICY] [-G USEC]] [-M] [FILE]
+//    Perform NOPS * NTHREADS “bank transfers” within FILE. With `-T`,
+//    accounts live in an in-memory table that is written back
+//    periodically and on close.
+//    `-C` also runs transfers optimistically, without account locks
+//    (see `ftx_transfer_optimistic`), and reports how many were rerun.
+//
+//    `-W` logs every transfer to write-ahead log WAL and checkpoints the
+//    table periodically (see `ftx_db::open_wal`). POLICY (`buffered`,
+//    `flush`, or `fsync`) says when a logged transfer counts as done, and
+//    USEC lets each group commit gather more transfers. A log is only
+//    replayed into a database modified in place (`-M`); to recover from
+//    a crash, run `./ftxxfer -M -W WAL -n 0 FILE`.
+
+// transfer(bal, amount)
+//   Moves up to `amount` from `bal[0]` to `bal[1]`, after a delay that
+//   models network latency or heavy computation.
+static void transfer(long bal[2], long amount) {
+    usleep(1);
+    long delta = std::min(bal[0], amount);
+    delta = std::min(delta, 9999999 - bal[1]);
+    bal[0] -= delta;
+    bal[1] += delta;
+}
 
-static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
+static void transfer_thread(ftx_db& db, bool optimistic, size_t nops,
+                            size_t& opcount, size_t& nretries,
                             unsigned seed) {
     // Obtain a source of random account numbers
     std::mt19937 randomness(seed);
     std::uniform_int_distribution pick_account(size_t(0), db.naccounts - 1);
     std::normal_distribution pick_amount(100.0, 10.0);
+    ftx_ledger_buffer* walbuf = db.wal ? db.wal->thread_buffer() : nullptr;
 
     size_t i = 0;
+    nretries = 0;
     while (i != nops) {
         // Pick two random accounts for transfer
         size_t aindex[2] = {
@@ -22,31 +48,38 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
         if (aindex[0] == aindex[1]) {
             continue;
         }
+        long amount = (long) pick_amount(randomness);
+
+        if (optimistic) {
+            // Compute without locks; rerun if either account changed
+            nretries += ftx_transfer_optimistic(db, aindex, [&] (long bal[2]) {
+                transfer(bal, amount);
+            });
+            ++i;
+            continue;
+        }
 
-        // Lock both accounts; prevent deadlock with lock ordering
+        // Lock both accounts at once
         ftx_acct acct1{db, aindex[0]};
         ftx_acct acct2{db, aindex[1]};
-        std::unique_lock guard1{aindex[0] < aindex[1] ? acct1 : acct2};
-        std::unique_lock guard2{aindex[0] < aindex[1] ? acct2 : acct1};
+        ftx_lockset lockset{&acct1, &acct2};
+        std::unique_lock guard{lockset};
 
-        // Read current balances
+        // Read current balances, transfer, and update balances
         long bal[2];
         acct1.read(nullptr, 0, &bal[0]);
         acct2.read(nullptr, 0, &bal[1]);
-
-        // Model network delay or heavy computation
-        usleep(1);
-
-        // Compute amount to transfer
-        long delta = std::min(bal[0], (long) pick_amount(randomness));
-        delta = std::min(delta, 9999999 - bal[1]);
-        bal[0] -= delta;
-        bal[1] += delta;
-
-        // Update balances
+        transfer(bal, amount);
         acct1.write(bal[0]);
         acct2.write(bal[1]);
 
+        // Log the transfer, then wait for its commit without the locks
+        if (db.wal) {
+            uint64_t seq = db.log_update(walbuf, {&acct1, &acct2});
+            guard.unlock();
+            db.wal->wait_committed(seq);
+        }
+
         ++i;
     }
     opcount = i;
@@ -55,9 +88,15 @@ static void transfer_thread(ftx_db& db, size_t nops, size_t& opcount,
 
 int main(int argc, char* argv[]) {
     // Parse arguments
-    io61_args args = io61_args("i:D:j:n:").set_nthreads(4)
+    io61_args args = io61_args("i:D:j:n:MTCW:S:G:").set_nthreads(4)
         .set_noperations(100'000)
         .parse(argc, argv);
+    if (args.optimistic && args.wal_file) {
+        fprintf(stderr, "ftxxfer: -C cannot be combined with -W\n");
+        exit(1);
+    } else if (args.optimistic) {
+        args.memtable = true;
+    }
 
     // Allocate buffer, open files
     ftx_db* db = ftx_db::open_args(args);
@@ -68,16 +107,18 @@ int main(int argc, char* argv[]) {
     // Run transfers
     std::vector<std::thread> th(args.nthreads);
     std::vector<size_t> opcounts(args.nthreads, 0);
+    std::vector<size_t> retries(args.nthreads, 0);
     for (int i = 0; i != args.nthreads; ++i) {
-        th[i] = std::thread(transfer_thread, std::ref(*db),
+        th[i] = std::thread(transfer_thread, std::ref(*db), args.optimistic,
                             args.noperations, std::ref(opcounts[i]),
-                            seed_randomness());
+                            std::ref(retries[i]), seed_randomness());
     }
 
-    size_t totalops = 0;
+    size_t totalops = 0, totalretries = 0;
     for (int i = 0; i != args.nthreads; ++i) {
         th[i].join();
         totalops += opcounts[i];
+        totalretries += retries[i];
     }
 
     // Flush and close
@@ -92,4 +133,8 @@ int main(int argc, char* argv[]) {
             totalops, totalops == 1 ? "operation" : "operations",
             (int) usage.ru_utime.tv_sec, (int) usage.ru_utime.tv_usec,
             end_time - start_time);
+    if (args.optimistic) {
+        fprintf(stderr, "%zu %s\n", totalretries,
+                totalretries == 1 ? "retry" : "retries");
+    }
 }
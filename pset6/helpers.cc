@@ -159,6 +159,27 @@ io61_args& io61_args::parse(int argc, char** argv) {
         case 'M':
             this->modify = true;
             break;
+        case 'X':
+            this->exclusive = true;
+            break;
+        case 'T':
+            this->memtable = true;
+            break;
+        case 'C':
+            this->optimistic = true;
+            break;
+        case 'S':
+            this->sync_policy = optarg;
+            break;
+        case 'W':
+            this->wal_file = optarg;
+            break;
+        case 'G':
+            this->commit_delay = strtoul(optarg, &endptr, 0);
+            if (endptr == optarg || *endptr) {
+                goto usage;
+            }
+            break;
         case 'r': {
             unsigned long n = strtoul(optarg, &endptr, 0);
             if (endptr == optarg || *endptr) {
@@ -319,6 +340,24 @@ void io61_args::usage() {
     if (strchr(this->opts, 'M')) {
         fprintf(stderr, "    -M            Modify input file in place\n");
     }
+    if (strchr(this->opts, 'X')) {
+        fprintf(stderr, "    -X            Take exclusive locks only\n");
+    }
+    if (strchr(this->opts, 'T')) {
+        fprintf(stderr, "    -T            Keep accounts in an in-memory table\n");
+    }
+    if (strchr(this->opts, 'C')) {
+        fprintf(stderr, "    -C            Transfer optimistically, without locks (implies -T)\n");
+    }
+    if (strchr(this->opts, 'S')) {
+        fprintf(stderr, "    -S POLICY     Sync ledger commits: buffered, flush, or fsync\n");
+    }
+    if (strchr(this->opts, 'W')) {
+        fprintf(stderr, "    -W WAL        Log transfers to write-ahead log WAL (implies -T)\n");
+    }
+    if (strchr(this->opts, 'G')) {
+        fprintf(stderr, "    -G USEC       Let group commits gather for USEC microseconds\n");
+    }
 }
 
 void io61_args::after_open() {
@@ -350,6 +389,11 @@ void io61_args::after_open(int fd, int mode) {
 
 void io61_args::after_open(io61_file* f, int mode) {
     this->after_open(io61_fileno(f), mode);
+    if (this->pipebuf_size > 0) {
+        // pick a cache size that matches the new pipe buffer
+        int r = io61_set_bufsize(f, 0);
+        (void) r;
+    }
 }
 
 void io61_args::after_open(FILE* f, int mode) {
@@ -2,24 +2,121 @@
 #include <climits>
 #include <cerrno>
 #include <mutex>
-#include <shared_mutex>
 #include <condition_variable>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <atomic>
 #include <thread>
 #include <unordered_map>
 #include <map>
+#include <algorithm>
+#include <list>
+#include <memory>
 #include <iostream>
 
 // io61.cc
 //    YOUR CODE HERE!
 
-// Struct keeps track of whether region is locked and who owns it
-struct region_lock {
-    unsigned locked = 0;
+// io61_range_lock
+//    A lock on [start, start + len), held or (in `io61_file::xwaiters`)
+//    waited for; the start is its key in the containing map.
+struct io61_range_lock {
+    off_t len;
     std::thread::id owner;
+    int locktype;              // `LOCK_SH` or `LOCK_EX`
+    double acquired = 0;       // when acquired (`io61_now`), for statistics
 };
 
+// io61_lock_waiter
+//    A thread blocked in `io61_lock_many` on `locktype` locks on the
+//    `nranges` ranges in `ranges`. Each waiter sleeps on its own condition
+//    variable, so `io61_unlock` can wake only the waiters whose ranges
+//    overlap the released range. The waiters are also the nodes of the
+//    wait-for graph that `io61_lock_would_deadlock` searches.
+struct io61_lock_waiter {
+    const io61_range* ranges;
+    size_t nranges;
+    int locktype;
+    std::thread::id owner;
+    unsigned long seq;         // arrival order, for `IO61_LOCK_FIFO`
+    int priority;              // from `io61_set_lock_priority`
+    std::condition_variable_any cv;
+};
+
+// io61_stats
+//    Per-file counters, printed by `io61_close` when `IO61_STATS` is set in
+//    the environment. A hit is an io61 read, write, pread, or pwrite call
+//    served entirely by the cache; a miss needed a fill or flush. Threads
+//    share files, so counters are atomic. `blocked_ns` (time spent in
+//    system calls) is measured only when `IO61_STATS` is set.
+struct io61_stats {
+    std::atomic<unsigned long> nreads = 0;
+    std::atomic<unsigned long> nwrites = 0;
+    std::atomic<unsigned long> nseeks = 0;
+    std::atomic<unsigned long> npreads = 0;
+    std::atomic<unsigned long> npwrites = 0;
+    std::atomic<unsigned long long> bytes_read = 0;
+    std::atomic<unsigned long long> bytes_written = 0;
+    std::atomic<unsigned long> hits = 0;
+    std::atomic<unsigned long> misses = 0;
+    std::atomic<unsigned long> nflushes = 0;
+    std::atomic<unsigned long long> blocked_ns = 0;
+};
+
+// io61_lock_stats
+//    Range-lock counters, printed by `io61_close` with the `io61_stats`.
+//    They are updated under `f->rm`, and only when `IO61_STATS` is set.
+//    An acquisition is one successful `io61_lock`, `io61_lock_many`, or
+//    `io61_try_lock` call; it is contended if it had to wait. Bucket `i`
+//    of `hold_hist` counts locks held for [2^(i-1), 2^i) microseconds
+//    (bucket 0: under 1us; the last bucket also counts longer holds).
+//    `hot` accumulates waits by requested range; `IO61_HOTRANGES=N`
+//    prints the N ranges with the most total wait time.
+struct io61_range_heat {
+    unsigned long ncontended = 0;
+    double wait = 0;
+};
+
+static constexpr int io61_hold_buckets = 24;
+
+struct io61_lock_stats {
+    unsigned long nacquired = 0;
+    unsigned long ncontended = 0;
+    unsigned long ndeadlocks = 0;
+    double wait_total = 0;
+    double wait_max = 0;
+    unsigned long hold_hist[io61_hold_buckets] = {};
+    std::map<std::pair<off_t, off_t>, io61_range_heat> hot;
+};
+
+static bool io61_stats_on = false;
+static int io61_hot_ranges = 0;
+static thread_local int io61_lock_priority = 0;
+
+// io61_pslot
+//    One slot of the positioned cache (see `io61_pio`). Fills, writes, and
+//    writebacks hold `m`. Reads that hit take no lock: `seq` is odd while
+//    `tag`, `end_tag`, or `buf` change, so a reader can tell that its copy
+//    raced with a change and retry under `m`.
+
+struct io61_pslot {
+    std::mutex m;
+    std::atomic<unsigned> seq = 0;  // sequence lock for lock-free reads
+    std::atomic<off_t> tag = -1;     // offset of first character in `buf`
+    std::atomic<off_t> end_tag = -1; // offset one past last valid character
+    bool dirty = false;        // has slot been written since it was filled?
+    off_t dirty_tag;           // if `dirty`, offset of first written character
+    off_t dirty_end_tag;       // if `dirty`, offset one past last written one
+    unsigned char* buf;        // `pslotsz` bytes inside `io61_file::pcache`
+};
+
+// The positioned cache takes at most this much memory per file, enough
+// to hold an account database. With the default page-sized slots that
+// is 128 slots.
+static constexpr size_t io61_page_size = 4096;
+static constexpr size_t io61_pcache_size = 128 * io61_page_size;
+
 // io61_file
 //    Data structure for io61 file wrappers.
 
@@ -29,32 +126,99 @@ struct io61_file {
     bool seekable;   // is this file seekable?
     size_t filesize; // How large is this file?
 
-    // Single-slot cache
-    static constexpr off_t cbufsz = 8192;
-    unsigned char cbuf[cbufsz];
+    // Single-slot cache for `io61_read` and `io61_write`
+    off_t cbufsz;    // size of `cbuf` (see `io61_default_bufsize`)
+    unsigned char* cbuf;
     off_t tag;       // offset of first character in `cbuf`
     off_t pos_tag;   // next offset to read or write (non-positioned mode)
     off_t end_tag;   // offset one past last valid character in `cbuf`
-
-    // Positioned mode
     std::atomic<bool> dirty = false;       // has cache been written?
-    bool positioned = false;  // is cache in positioned mode?
+
+    // Positioned mode: a direct-mapped cache of page-aligned slots
+    std::atomic<bool> positioned = false;  // is file in positioned mode?
+    size_t pslotsz = io61_page_size;       // size of each slot
+    std::unique_ptr<io61_pslot[]> pslots;  // null until first used
+    size_t npslots = 0;
+    unsigned char* pcache = nullptr;       // memory for all slots
 
     // Synchronization stuff
     std::recursive_mutex rm ;
-    std::condition_variable_any cv;
+    std::list<io61_lock_waiter*> waiters;  // threads blocked in `io61_lock`
+    int lock_policy = IO61_LOCK_BARGE;     // see `io61_set_lock_policy`
+    unsigned long lock_seq = 0;            // last waiter's `seq`
+
+    // Range locks, keyed by start offset. A lock that overlaps offset
+    // `off` starts after `off - max_lock_len`, which bounds the search.
+    // `xwaiters` holds exclusive requests blocked in `io61_lock`; new
+    // shared requests queue behind them so readers can't starve writers.
+    std::multimap<off_t, io61_range_lock> locks;
+    std::multimap<off_t, io61_range_lock> xwaiters;
+    off_t max_lock_len = 0;
+
+    io61_stats st;   // counters (see `io61_stats`)
+    io61_lock_stats lst;   // range-lock counters, under `rm`
+
+    ~io61_file() {
+        delete[] cbuf;
+        free(pcache);
+    }
+};
 
-    region_lock reg[9];
 
-};
+// io61_now()
+//    Returns the current time when statistics are on, and 0 otherwise.
 
-// Returns proper index into region lock array
-static int file_region(off_t off) {
-    if (off < 48) {
-        return 0;
+static double io61_now() {
+    return io61_stats_on ? monotonic_timestamp() : 0;
+}
+
+// io61_count_blocked(f, t0)
+//    Adds the time since `t0` (from `io61_now`) to `f`'s blocked time.
+
+static void io61_count_blocked(io61_file* f, double t0) {
+    if (io61_stats_on) {
+        f->st.blocked_ns += (unsigned long long) ((monotonic_timestamp() - t0) * 1e9);
+    }
+}
+
+
+// io61_default_bufsize(fd)
+//    Picks a cache size for `fd`. `IO61_BUFSIZE` in the environment
+//    overrides the choice for every file. Otherwise pipes get their
+//    capacity, sockets their kernel buffer size, and everything else its
+//    preferred block size, but at least 8192 bytes.
+
+static off_t io61_default_bufsize(int fd) {
+    static constexpr off_t min_bufsize = 4096;
+    static constexpr off_t max_bufsize = 16 << 20;
+    off_t sz = 8192;
+
+    struct stat s;
+    const char* env = getenv("IO61_BUFSIZE");
+    if (env && *env) {
+        sz = strtol(env, nullptr, 0);
+    } else if (fstat(fd, &s) == -1) {
+        // keep default
+    } else if (S_ISFIFO(s.st_mode)) {
+#ifdef F_GETPIPE_SZ
+        int psz = fcntl(fd, F_GETPIPE_SZ);
+        sz = psz > 0 ? psz : 65536;
+#else
+        sz = 65536;
+#endif
+    } else if (S_ISSOCK(s.st_mode)) {
+        int ssz = 0;
+        socklen_t len = sizeof(ssz);
+        if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ssz, &len) == 0 && ssz > 0) {
+            sz = ssz;
+        }
     } else {
-        return std::min((off - (off % 1024)) + 1, (off_t) 8);
+        sz = std::max((off_t) s.st_blksize, sz);
+        if (s.st_blksize > 0 && sz % s.st_blksize != 0) {
+            sz += s.st_blksize - sz % s.st_blksize;
+        }
     }
+    return std::min(std::max(sz, min_bufsize), max_bufsize);
 }
 
 
@@ -79,21 +243,125 @@ io61_file* io61_fdopen(int fd, int mode) {
     }
     f->dirty = f->positioned = false;
     f->filesize = io61_filesize(f);
+    f->cbufsz = io61_default_bufsize(fd);
+    f->cbuf = new unsigned char[f->cbufsz];
+    const char* stats_env = getenv("IO61_STATS");
+    io61_stats_on = stats_env && *stats_env && strcmp(stats_env, "0") != 0;
+    const char* hot_env = getenv("IO61_HOTRANGES");
+    io61_hot_ranges = hot_env ? std::max(atoi(hot_env), 0) : 0;
+    const char* policy_env = getenv("IO61_LOCKPOLICY");
+    if (policy_env && strcmp(policy_env, "fifo") == 0) {
+        f->lock_policy = IO61_LOCK_FIFO;
+    } else if (policy_env && strcmp(policy_env, "priority") == 0) {
+        f->lock_policy = IO61_LOCK_PRIORITY;
+    }
     return f;
 }
 
 
+// io61_print_lock_stats(f)
+//    Prints `f`'s range-lock statistics, if it was ever locked, and its
+//    hottest ranges if `IO61_HOTRANGES` is set.
+
+static void io61_print_lock_stats(io61_file* f) {
+    std::unique_lock guard(f->rm);
+    const io61_lock_stats& lst = f->lst;
+    if (lst.nacquired == 0 && lst.ndeadlocks == 0) {
+        return;
+    }
+    fprintf(stderr, "io61 fd %d locks: %lu acquired, %lu contended, "
+            "%lu deadlocks, %.6fs waited, %.6fs max wait\n",
+            f->fd, lst.nacquired, lst.ncontended, lst.ndeadlocks,
+            lst.wait_total, lst.wait_max);
+
+    fprintf(stderr, "io61 fd %d lock hold times:", f->fd);
+    for (int i = 0; i != io61_hold_buckets; ++i) {
+        if (lst.hold_hist[i] != 0) {
+            fprintf(stderr, " %s%luus %lu", i == 0 ? "<" : ">=",
+                    i == 0 ? 1UL : 1UL << (i - 1), lst.hold_hist[i]);
+        }
+    }
+    fprintf(stderr, "\n");
+
+    std::vector<std::pair<std::pair<off_t, off_t>, io61_range_heat>> hot(
+        lst.hot.begin(), lst.hot.end()
+    );
+    size_t nhot = std::min(hot.size(), (size_t) io61_hot_ranges);
+    std::partial_sort(hot.begin(), hot.begin() + nhot, hot.end(),
+                      [] (const auto& a, const auto& b) {
+                          return a.second.wait > b.second.wait;
+                      });
+    for (size_t i = 0; i != nhot; ++i) {
+        fprintf(stderr, "io61 fd %d hot range [%lld, %lld): %lu contended, "
+                "%.6fs waited\n", f->fd, (long long) hot[i].first.first,
+                (long long) (hot[i].first.first + hot[i].first.second),
+                hot[i].second.ncontended, hot[i].second.wait);
+    }
+}
+
+
 // io61_close(f)
 //    Closes the io61_file `f` and releases all its resources.
 
 int io61_close(io61_file* f) {
     io61_flush(f);
+    if (io61_stats_on) {
+        const io61_stats& st = f->st;
+        fprintf(stderr, "io61 fd %d: %lu reads, %lu writes, %lu seeks, "
+                "%lu preads, %lu pwrites, %llu bytes read, %llu bytes written, "
+                "%lu flushes, %lu hits, %lu misses, %.6fs blocked\n",
+                f->fd, st.nreads.load(), st.nwrites.load(), st.nseeks.load(),
+                st.npreads.load(), st.npwrites.load(),
+                st.bytes_read.load(), st.bytes_written.load(),
+                st.nflushes.load(), st.hits.load(), st.misses.load(),
+                st.blocked_ns.load() / 1e9);
+        io61_print_lock_stats(f);
+    }
     int r = close(f->fd);
     delete f;
     return r;
 }
 
 
+// io61_set_bufsize(f, sz)
+//    Changes the cache size of `f` to `sz` bytes. If `sz` is 0, picks a
+//    default based on the file's type. Flushes `f` first; unread data
+//    that cannot be dropped (for instance, on a pipe) is kept. Positioned
+//    I/O uses slots of `sz` bytes rounded up to a page (one page if `sz`
+//    is 0), as many as fit in the positioned cache. Returns 0 on success
+//    and -1 on error.
+
+int locked_io61_flush(io61_file* f);
+
+int io61_set_bufsize(io61_file* f, size_t sz) {
+    std::unique_lock guard(f->rm);
+    if (locked_io61_flush(f) == -1) {
+        return -1;
+    }
+
+    // Positioned slots are reallocated at the new size on next use
+    f->pslotsz = std::max((sz + io61_page_size - 1) & ~(io61_page_size - 1),
+                          io61_page_size);
+    f->pslots.reset();
+    f->npslots = 0;
+    free(f->pcache);
+    f->pcache = nullptr;
+
+    if (sz == 0) {
+        sz = io61_default_bufsize(f->fd);
+    }
+    size_t nunread = f->positioned ? 0 : f->end_tag - f->pos_tag;
+    sz = std::max(sz, nunread);
+    unsigned char* cbuf = new unsigned char[sz];
+    memcpy(cbuf, &f->cbuf[f->pos_tag - f->tag], nunread);
+    delete[] f->cbuf;
+    f->cbuf = cbuf;
+    f->cbufsz = sz;
+    f->tag = f->pos_tag;
+    return 0;
+}
+
+
 // NORMAL READING AND WRITING FUNCTIONS
 
 // io61_readc(f)
@@ -105,10 +373,13 @@ static int io61_fill(io61_file* f);
 int io61_readc(io61_file* f) {
     assert(!f->positioned);
     if (f->pos_tag == f->end_tag) {
+        ++f->st.misses;
         io61_fill(f);
         if (f->pos_tag == f->end_tag) {
             return -1;
         }
+    } else {
+        ++f->st.hits;
     }
     unsigned char ch = f->cbuf[f->pos_tag - f->tag];
     ++f->pos_tag;
@@ -129,6 +400,7 @@ int io61_readc(io61_file* f) {
 ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
     assert(!f->positioned);
     std::unique_lock guard(f->rm);
+    unsigned long nreads0 = f->st.nreads;
     size_t nread = 0;
     while (nread != sz) {
         if (f->pos_tag == f->end_tag) {
@@ -145,6 +417,7 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
         nread += ncopy;
         f->pos_tag += ncopy;
     }
+    ++(f->st.nreads == nreads0 ? f->st.hits : f->st.misses);
     return nread;
 }
 
@@ -156,10 +429,13 @@ ssize_t io61_read(io61_file* f, unsigned char* buf, size_t sz) {
 int io61_writec(io61_file* f, int c) {
     assert(!f->positioned);
     if (f->pos_tag == f->tag + f->cbufsz) {
+        ++f->st.misses;
         int r = io61_flush(f);
         if (r == -1) {
             return -1;
         }
+    } else {
+        ++f->st.hits;
     }
     f->cbuf[f->pos_tag - f->tag] = c;
     ++f->pos_tag;
@@ -179,6 +455,7 @@ int io61_writec(io61_file* f, int c) {
 ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
     assert(!f->positioned);
     std::unique_lock guard(f->rm);
+    unsigned long nflushes0 = f->st.nflushes;
     size_t nwritten = 0;
     while (nwritten != sz) {
         if (f->end_tag == f->tag + f->cbufsz) {
@@ -197,6 +474,7 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
         f->dirty = true;
         nwritten += ncopy;
     }
+    ++(f->st.nflushes == nflushes0 ? f->st.hits : f->st.misses);
     return nwritten;
 }
 
@@ -210,13 +488,14 @@ ssize_t io61_write(io61_file* f, const unsigned char* buf, size_t sz) {
 //    data cached for reading and seeks to the logical file position.
 
 static int io61_flush_dirty(io61_file* f);
-static int io61_flush_dirty_positioned(io61_file* f);
+static int io61_flush_positioned(io61_file* f);
 static int io61_flush_clean(io61_file* f);
 
 // Only accessible by threads w/mutex
 int locked_io61_flush(io61_file* f) {
-    if (f->dirty && f->positioned) {
-        return io61_flush_dirty_positioned(f);
+    ++f->st.nflushes;
+    if (f->positioned) {
+        return io61_flush_positioned(f);
     } else if (f->dirty) {
         return io61_flush_dirty(f);
     } else {
@@ -241,10 +520,15 @@ int io61_seek(io61_file* f, off_t off) {
         return -1;
     }
     off_t roff = lseek(f->fd, off, SEEK_SET);
+    ++f->st.nseeks;
     if (roff == -1) {
         return -1;
     }
     f->tag = f->pos_tag = f->end_tag = off;
+    // Stream writes may change data cached in positioned slots
+    for (size_t i = 0; i != f->npslots; ++i) {
+        f->pslots[i].tag = f->pslots[i].end_tag = -1;
+    }
     f->positioned = false;
     return 0;
 }
@@ -254,19 +538,26 @@ int io61_seek(io61_file* f, off_t off) {
 
 // io61_fill(f)
 //    Fill the cache by reading from the file. Returns 0 on success,
-//    -1 on error. Used only for non-positioned files.
+//    -1 on error. Used only for non-positioned files whose cache has
+//    been read to the end.
 
 static int io61_fill(io61_file* f) {
-    assert(f->tag == f->end_tag && f->pos_tag == f->end_tag);
+    assert(f->pos_tag == f->end_tag && !f->dirty);
+    f->tag = f->end_tag;
     ssize_t nr;
+    double t0 = io61_now();
     while (true) {
         nr = read(f->fd, f->cbuf, f->cbufsz);
+        ++f->st.nreads;
         if (nr >= 0) {
             break;
         } else if (errno != EINTR && errno != EAGAIN) {
+            io61_count_blocked(f, t0);
             return -1;
         }
     }
+    io61_count_blocked(f, t0);
+    f->st.bytes_read += nr;
     f->end_tag += nr;
     return 0;
 }
@@ -279,40 +570,45 @@ static int io61_flush_dirty(io61_file* f) {
     // Called when `f`’s cache is dirty and not positioned.
     // Uses `write`; assumes that the initial file position equals `f->tag`.
     off_t flush_tag = f->tag;
+    double t0 = io61_now();
     while (flush_tag != f->end_tag) {
         ssize_t nw = write(f->fd, &f->cbuf[flush_tag - f->tag],
                            f->end_tag - flush_tag);
+        ++f->st.nwrites;
         if (nw >= 0) {
             flush_tag += nw;
         } else if (errno != EINTR && errno != EINVAL) {
+            io61_count_blocked(f, t0);
             return -1;
         }
     }
+    io61_count_blocked(f, t0);
+    f->st.bytes_written += f->end_tag - f->tag;
     f->dirty = false;
     f->tag = f->pos_tag = f->end_tag;
     return 0;
 }
 
-static int io61_flush_dirty_positioned(io61_file* f) {
-    // Called when `f`’s cache is dirty and positioned.
-    // Uses `pwrite`; does not change file position.
-    off_t flush_tag = f->tag;
-    while (flush_tag != f->end_tag) {
-        ssize_t nw = pwrite(f->fd, &f->cbuf[flush_tag - f->tag],
-                            f->end_tag - flush_tag, flush_tag);
-        if (nw >= 0) {
-            flush_tag += nw;
-        } else if (errno != EINTR && errno != EINVAL) {
-            return -1;
+static int io61_pslot_writeback(io61_file* f, io61_pslot& s);
+
+static int io61_flush_positioned(io61_file* f) {
+    // Called when `f` is positioned. Writes back every dirty slot, which
+    // stays cached.
+    int r = 0;
+    for (size_t i = 0; i != f->npslots; ++i) {
+        io61_pslot& s = f->pslots[i];
+        std::unique_lock guard(s.m);
+        if (s.dirty && io61_pslot_writeback(f, s) == -1) {
+            r = -1;
         }
     }
-    f->dirty = false;
-    return 0;
+    return r;
 }
 
 static int io61_flush_clean(io61_file* f) {
     // Called when `f`’s cache is clean.
     if (!f->positioned && f->seekable) {
+        ++f->st.nseeks;
         if (lseek(f->fd, f->pos_tag, SEEK_SET) == -1) {
             return -1;
         }
@@ -324,70 +620,273 @@ static int io61_flush_clean(io61_file* f) {
 
 
 // POSITIONED I/O FUNCTIONS
+//
+//    Positioned I/O uses its own cache: `pslots`, a direct-mapped array
+//    of page-aligned slots, each with its own dirty range. A slot is filled
+//    with `pread` on a miss, and its dirty range is written back with
+//    `pwrite` when the slot is evicted or `f` is flushed. Only bytes
+//    written through `f` are written back, so handles that share a file
+//    can write disjoint ranges of the same page. 128 page-sized slots hold a
+//    whole account database, so random accesses keep hitting.
+//
+//    Concurrent callers are safe without range locks. Each slot has its
+//    own lock, so accesses to different slots never wait for each other,
+//    and reads that hit use a sequence lock instead of waiting at all.
+//    `f->rm` is taken only to enter positioned mode and to flush.
+
+static ssize_t io61_pio(io61_file* f, unsigned char* buf, size_t sz,
+                        off_t off, bool write);
 
 // io61_pread(f, buf, sz, off)
 //    Read up to `sz` bytes from `f` into `buf`, starting at offset `off`.
-//    Returns the number of characters read or -1 on error.
+//    Returns the number of characters read, 0 at end of file, or -1 on
+//    error.
 //
-//    This function can only be called when `f` was opened in read/write
-//    more (O_RDWR).
-
-static int io61_pfill(io61_file* f, off_t off);
+//    This function can only be called when `f` was opened read-only
+//    (O_RDONLY) or in read/write mode (O_RDWR).
 
 ssize_t io61_pread(io61_file* f, unsigned char* buf, size_t sz,
                    off_t off) {
-    if (!f->positioned || off < f->tag || off >= f->end_tag) {
-        if (io61_pfill(f, off) == -1) {
-            return -1;
-        }
-    }
-    size_t nleft = f->end_tag - off;
-    size_t ncopy = std::min(sz, nleft);
-    memcpy(buf, &f->cbuf[off - f->tag], ncopy);
-    return ncopy;
+    return io61_pio(f, buf, sz, off, false);
 }
 
 
 // io61_pwrite(f, buf, sz, off)
 //    Write up to `sz` bytes from `buf` into `f`, starting at offset `off`.
-//    Returns the number of characters written or -1 on error.
+//    Returns the number of characters written or -1 on error. Positioned
+//    writes cannot extend the file, so this returns 0 at end of file.
 //
 //    This function can only be called when `f` was opened in read/write
 //    more (O_RDWR).
 
 ssize_t io61_pwrite(io61_file* f, const unsigned char* buf, size_t sz,
                     off_t off) {
-    if (!f->positioned || off < f->tag || off >= f->end_tag) {
-        if (io61_pfill(f, off) == -1) {
+    return io61_pio(f, const_cast<unsigned char*>(buf), sz, off, true);
+}
+
+
+static int io61_pslot_writeback(io61_file* f, io61_pslot& s);
+
+// io61_begin_positioned(f)
+//    Switches `f` to positioned mode: flushes the stream cache and
+//    allocates the slots. Returns 0 on success and -1 on error.
+
+static int io61_begin_positioned(io61_file* f) {
+    assert(f->mode != O_WRONLY);
+    std::unique_lock guard(f->rm);
+    if (f->positioned) {
+        return 0;
+    }
+    if (locked_io61_flush(f) == -1) {
+        return -1;
+    }
+    if (!f->pslots) {
+        size_t nslots = std::max(io61_pcache_size / f->pslotsz, (size_t) 1);
+        f->pcache = (unsigned char*) aligned_alloc(io61_page_size, nslots * f->pslotsz);
+        f->pslots.reset(new io61_pslot[nslots]);
+        f->npslots = nslots;
+        for (size_t i = 0; i != nslots; ++i) {
+            f->pslots[i].buf = &f->pcache[i * f->pslotsz];
+        }
+    }
+    f->positioned = true;
+    return 0;
+}
+
+// io61_fence(order)
+//   `std::atomic_thread_fence`. ThreadSanitizer can't model fences and
+//   warns about them; the sequence lock needs them anyway, because a
+//   fill's `pread` writes slot data with plain stores.
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wtsan"
+#endif
+static inline void io61_fence(std::memory_order order) {
+    std::atomic_thread_fence(order);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+// io61_pslot_begin_change(s), io61_pslot_end_change(s)
+//   Bracket a change to slot `s`'s `tag`, `end_tag`, or `buf`, so that
+//   lock-free readers retry. The release fence after the odd `seq` keeps
+//   every change, including the kernel's stores during `pread`, from
+//   becoming visible before it. Require `s.m`.
+
+static void io61_pslot_begin_change(io61_pslot& s) {
+    s.seq.store(s.seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_relaxed);
+    io61_fence(std::memory_order_release);
+}
+
+static void io61_pslot_end_change(io61_pslot& s) {
+    s.seq.store(s.seq.load(std::memory_order_relaxed) + 1,
+                std::memory_order_release);
+}
+
+// io61_pslot_fill(f, s, tag)
+//    Loads slot `s` with the data at offset `tag`, first writing back its
+//    dirty contents. Returns 0 on success and -1 on error. Requires `s.m`.
+
+static int io61_pslot_fill(io61_file* f, io61_pslot& s, off_t tag) {
+    if (s.dirty && io61_pslot_writeback(f, s) == -1) {
+        return -1;
+    }
+
+    io61_pslot_begin_change(s);
+    s.tag = s.end_tag = -1;
+    double t0 = io61_now();
+    ssize_t nr;
+    do {
+        nr = pread(f->fd, s.buf, f->pslotsz, tag);
+        ++f->st.npreads;
+    } while (nr == -1 && errno == EINTR);
+    io61_count_blocked(f, t0);
+    if (nr != -1) {
+        f->st.bytes_read += nr;
+        s.tag = tag;
+        s.end_tag = tag + nr;
+    }
+    io61_pslot_end_change(s);
+    return nr == -1 ? -1 : 0;
+}
+
+// io61_pslot_copy(f, s, buf, sz, off, write)
+//    Copies up to `sz` bytes between `buf` and cached slot `s`, starting
+//    at offset `off`, and returns the number copied (0 past the end of the
+//    slot's data) or -1 on error. A write that would leave a gap in the
+//    slot's dirty range first writes the old range back. Requires `s.m`.
+
+static ssize_t io61_pslot_copy(io61_file* f, io61_pslot& s,
+                               unsigned char* buf, size_t sz, off_t off,
+                               bool write) {
+    size_t ncopy = std::min(sz, (size_t) std::max(s.end_tag - off, (off_t) 0));
+    off_t end = off + ncopy;
+    if (ncopy != 0 && write) {
+        if (s.dirty && (off > s.dirty_end_tag || end < s.dirty_tag)
+            && io61_pslot_writeback(f, s) == -1) {
             return -1;
         }
+        // Store bytewise so lock-free readers never see a torn access
+        io61_pslot_begin_change(s);
+        unsigned char* dst = &s.buf[off - s.tag];
+        for (size_t i = 0; i != ncopy; ++i) {
+            __atomic_store_n(&dst[i], buf[i], __ATOMIC_RELAXED);
+        }
+        io61_pslot_end_change(s);
+        if (!s.dirty) {
+            s.dirty_tag = off;
+            s.dirty_end_tag = end;
+            s.dirty = true;
+        } else {
+            s.dirty_tag = std::min(s.dirty_tag, off);
+            s.dirty_end_tag = std::max(s.dirty_end_tag, end);
+        }
+    } else if (ncopy != 0) {
+        memcpy(buf, &s.buf[off - s.tag], ncopy);
     }
-    size_t nleft = f->end_tag - off;
-    size_t ncopy = std::min(sz, nleft);
-    memcpy(&f->cbuf[off - f->tag], buf, ncopy);
-    f->dirty = true;
     return ncopy;
 }
 
+// io61_pslot_try_read(f, s, tag, buf, sz, off)
+//    Copies up to `sz` bytes at offset `off` from slot `s` into `buf`
+//    without locking the slot, and returns the number copied. Returns -1
+//    if `s` does not hold offset `tag` or changed during the copy; the
+//    caller should then lock the slot and try again.
 
-// io61_pfill(f, off)
-//    Fill the single-slot cache with data including offset `off`.
-//    The handout code rounds `off` down to a multiple of 8192.
-
-static int io61_pfill(io61_file* f, off_t off) {
-    assert(f->mode == O_RDWR);
-    if (f->dirty && io61_flush(f) == -1) {
+static ssize_t io61_pslot_try_read(io61_file* f, io61_pslot& s, off_t tag,
+                                   unsigned char* buf, size_t sz, off_t off) {
+    unsigned seq = s.seq.load(std::memory_order_acquire);
+    if ((seq & 1) || s.tag.load(std::memory_order_relaxed) != tag) {
         return -1;
     }
+    // `end_tag` may belong to a later fill; clamp to the slot's buffer
+    off_t end_tag = std::min(s.end_tag.load(std::memory_order_relaxed),
+                             tag + (off_t) f->pslotsz);
+    size_t ncopy = std::min(sz, (size_t) std::max(end_tag - off, (off_t) 0));
+    const unsigned char* src = &s.buf[off - tag];
+    for (size_t i = 0; i != ncopy; ++i) {
+        buf[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    // Keep the copy before the final check of `seq`
+    io61_fence(std::memory_order_acquire);
+    if (s.seq.load(std::memory_order_relaxed) != seq) {
+        return -1;
+    }
+    return ncopy;
+}
+
+// io61_pio(f, buf, sz, off, write)
+//    Shared body of `io61_pread` (`write` false) and `io61_pwrite`.
+//    Copies slot by slot, so accesses that cross slots continue in the
+//    next one. Reads try a cached slot without locking first; misses,
+//    reads that race with a change, and writes lock the slot.
 
-    off = off - (off % 8192);
-    ssize_t nr = pread(f->fd, f->cbuf, f->cbufsz, off);
-    if (nr == -1) {
+static ssize_t io61_pio(io61_file* f, unsigned char* buf, size_t sz,
+                        off_t off, bool write) {
+    if (!f->positioned && io61_begin_positioned(f) == -1) {
         return -1;
     }
-    f->tag = off;
-    f->end_tag = off + nr;
-    f->positioned = true;
+    bool miss = false;
+    size_t n = 0;
+    while (n != sz) {
+        off_t o = off + n;
+        off_t tag = o - o % f->pslotsz;
+        io61_pslot& s = f->pslots[(tag / f->pslotsz) % f->npslots];
+
+        ssize_t ncopy = -1;
+        if (!write) {
+            ncopy = io61_pslot_try_read(f, s, tag, &buf[n], sz - n, o);
+        }
+        if (ncopy == -1) {
+            std::unique_lock guard(s.m);
+            if (s.tag != tag) {
+                miss = true;
+                if (io61_pslot_fill(f, s, tag) == -1) {
+                    if (n == 0) {
+                        return -1;
+                    }
+                    break;
+                }
+            }
+            ncopy = io61_pslot_copy(f, s, &buf[n], sz - n, o, write);
+        }
+
+        if (ncopy == -1 && n == 0) {
+            return -1;
+        } else if (ncopy <= 0) {
+            break;
+        }
+        n += ncopy;
+    }
+    ++(miss ? f->st.misses : f->st.hits);
+    return n;
+}
+
+
+// io61_pslot_writeback(f, s)
+//    Writes the dirty range of slot `s` back to the file with `pwrite`.
+//    Returns 0 on success and -1 on error. Requires `s.m`.
+
+static int io61_pslot_writeback(io61_file* f, io61_pslot& s) {
+    off_t flush_tag = s.dirty_tag;
+    double t0 = io61_now();
+    while (flush_tag != s.dirty_end_tag) {
+        ssize_t nw = pwrite(f->fd, &s.buf[flush_tag - s.tag],
+                            s.dirty_end_tag - flush_tag, flush_tag);
+        ++f->st.npwrites;
+        if (nw >= 0) {
+            flush_tag += nw;
+        } else if (errno != EINTR) {
+            io61_count_blocked(f, t0);
+            return -1;
+        }
+    }
+    io61_count_blocked(f, t0);
+    f->st.bytes_written += s.dirty_end_tag - s.dirty_tag;
+    s.dirty = false;
     return 0;
 }
 
@@ -395,28 +894,274 @@ static int io61_pfill(io61_file* f, off_t off) {
 
 // FILE LOCKING FUNCTIONS
 
-// Return true if some other thread (not `std::this_thread::get_id()`)
-// has a lock on a range of `f`, and that range might overlap with the
-// range [start, start + len).
+// range_conflicts(m, maxlen, start, len, locktype, owner, blockers)
+//    Returns true if `m` holds a range owned by a thread other than
+//    `owner` that overlaps [start, start + len) and is incompatible with
+//    `locktype`: shared locks are compatible only with other shared
+//    locks. `maxlen` bounds the length of every range in `m`. If
+//    `blockers` is nonnull, appends the owner of every such range to it.
+
+static bool range_conflicts(const std::multimap<off_t, io61_range_lock>& m,
+                            off_t maxlen, off_t start, off_t len,
+                            int locktype, std::thread::id owner,
+                            std::vector<std::thread::id>* blockers) {
+    bool conflict = false;
+    auto it = m.upper_bound(start - maxlen);
+    for (; it != m.end() && it->first < start + len; ++it) {
+        if (it->first + it->second.len > start
+            && it->second.owner != owner
+            && (locktype == LOCK_EX || it->second.locktype == LOCK_EX)) {
+            if (!blockers) {
+                return true;
+            }
+            blockers->push_back(it->second.owner);
+            conflict = true;
+        }
+    }
+    return conflict;
+}
+
+// holds_overlapping_lock(f, start, len, owner)
+//    Returns true if thread `owner` holds a lock overlapping
+//    [start, start + len).
+
+static bool holds_overlapping_lock(io61_file* f, off_t start, off_t len,
+                                   std::thread::id owner) {
+    auto it = f->locks.upper_bound(start - f->max_lock_len);
+    for (; it != f->locks.end() && it->first < start + len; ++it) {
+        if (it->first + it->second.len > start
+            && it->second.owner == owner) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// lock_conflicts(f, start, len, locktype, owner, blockers)
+//    Returns true if thread `owner` must wait for a `locktype` lock on
+//    [start, start + len) (see `overlaps_with_other_lock`). If `blockers`
+//    is nonnull, appends every thread the request is waiting for.
+
+static bool lock_conflicts(io61_file* f, off_t start, off_t len,
+                           int locktype, std::thread::id owner,
+                           std::vector<std::thread::id>* blockers) {
+    bool conflict = range_conflicts(f->locks, f->max_lock_len, start, len,
+                                    locktype, owner, blockers);
+    if (conflict && !blockers) {
+        return true;
+    }
+    if (locktype == LOCK_SH
+        && !f->xwaiters.empty()
+        && !holds_overlapping_lock(f, start, len, owner)) {
+        conflict = range_conflicts(f->xwaiters, f->max_lock_len, start, len,
+                                   LOCK_SH, owner, blockers)
+            || conflict;
+    }
+    return conflict;
+}
+
+// Return true if a `locktype` lock on [start, start + len) must wait:
+// some other thread holds an overlapping lock and at least one of the
+// two locks is exclusive. A shared request also waits behind an
+// overlapping exclusive request that is already waiting, which keeps a
+// steady stream of readers from starving writers. The exception is a
+// thread that already holds an overlapping lock; making it wait would
+// deadlock against a writer that is waiting for that very lock.
 //
-// This function may return true when another thread has a range lock on
-// `f` that *doesn’t* overlap with [start, start + len). That is, it can
-// be conservative, rather than precise. However, it *must return false*
-// if all range locks on `f` are held by *this* thread.
+// This function *must return false* if all range locks on `f` are held
+// by *this* thread.
 //
 // The caller must have locked all mutexes required to examine `f`’s
 // range lock state.
 
-bool overlaps_with_other_lock(io61_file* f, off_t start, off_t len) {
-    int rstart = file_region(start), rend = file_region(start + len - 1);
-    for (int ri = rstart; ri <= rend; ++ri) {
-        if (f->reg[ri].locked > 0 && f->reg[ri].owner != std::this_thread::get_id()) {
-            return true;
+bool overlaps_with_other_lock(io61_file* f, off_t start, off_t len,
+                              int locktype) {
+    return lock_conflicts(f, start, len, locktype,
+                          std::this_thread::get_id(), nullptr);
+}
+
+// waiter_goes_first(f, x, seq, priority)
+//    Returns true if `f`'s lock policy serves waiter `x` before a request
+//    with arrival number `seq` and priority `priority`.
+
+static bool waiter_goes_first(io61_file* f, const io61_lock_waiter* x,
+                              unsigned long seq, int priority) {
+    if (f->lock_policy == IO61_LOCK_PRIORITY && x->priority != priority) {
+        return x->priority > priority;
+    }
+    return x->seq < seq;
+}
+
+// queue_conflicts(f, ranges, n, locktype, owner, seq, priority, blockers)
+//    Under the FIFO and priority lock policies, returns true if a request
+//    by thread `owner` for `locktype` locks on the `n` ranges in `ranges`
+//    must stay behind a waiter that goes first and wants an overlapping,
+//    incompatible range. Waiters that wait for a lock `owner` already
+//    holds don't count; queueing behind them would deadlock. If
+//    `blockers` is nonnull, appends the owner of every such waiter.
+
+static bool queue_conflicts(io61_file* f, const io61_range* ranges, size_t n,
+                            int locktype, std::thread::id owner,
+                            unsigned long seq, int priority,
+                            std::vector<std::thread::id>* blockers) {
+    if (f->lock_policy == IO61_LOCK_BARGE) {
+        return false;
+    }
+    bool conflict = false;
+    for (const io61_lock_waiter* x : f->waiters) {
+        if (x->owner == owner
+            || (locktype == LOCK_SH && x->locktype == LOCK_SH)
+            || !waiter_goes_first(f, x, seq, priority)) {
+            continue;
+        }
+        bool overlap = false, waits_for_owner = false;
+        for (size_t i = 0; i != x->nranges; ++i) {
+            const io61_range& xr = x->ranges[i];
+            for (size_t j = 0; j != n && !overlap; ++j) {
+                overlap = ranges[j].len != 0 && xr.len != 0
+                    && xr.start < ranges[j].start + ranges[j].len
+                    && ranges[j].start < xr.start + xr.len;
+            }
+            waits_for_owner = waits_for_owner
+                || holds_overlapping_lock(f, xr.start, xr.len, owner);
+        }
+        if (overlap && !waits_for_owner) {
+            if (!blockers) {
+                return true;
+            }
+            blockers->push_back(x->owner);
+            conflict = true;
+        }
+    }
+    return conflict;
+}
+
+// io61_lock_would_deadlock(f, w)
+//    Returns true if waiter `w` is waiting, through a chain of other
+//    waiters, for its own thread. This searches the wait-for graph, where
+//    each waiting thread points at the threads that hold (or, as writers
+//    with priority or waiters ahead in the queue, wait for) ranges that
+//    conflict with its request.
+//    Every new edge touches a thread that is entering or resuming a wait,
+//    so checking at those times finds every cycle. Requires `f->rm`.
+
+static bool io61_lock_would_deadlock(io61_file* f, const io61_lock_waiter* w) {
+    std::vector<const io61_lock_waiter*> stack{w}, seen{w};
+    std::vector<std::thread::id> blockers;
+    while (!stack.empty()) {
+        const io61_lock_waiter* x = stack.back();
+        stack.pop_back();
+        blockers.clear();
+        for (size_t i = 0; i != x->nranges; ++i) {
+            lock_conflicts(f, x->ranges[i].start, x->ranges[i].len,
+                           x->locktype, x->owner, &blockers);
+        }
+        queue_conflicts(f, x->ranges, x->nranges, x->locktype, x->owner,
+                        x->seq, x->priority, &blockers);
+        for (std::thread::id u : blockers) {
+            if (u == w->owner) {
+                return true;
+            }
+            for (const io61_lock_waiter* y : f->waiters) {
+                if (y->owner == u
+                    && std::find(seen.begin(), seen.end(), y) == seen.end()) {
+                    seen.push_back(y);
+                    stack.push_back(y);
+                }
+            }
         }
     }
     return false;
 }
 
+// wake_waiters(f, start, len)
+//    Wakes the threads waiting for ranges that overlap [start, start + len).
+//    Requires `f->rm`.
+
+static void wake_waiters(io61_file* f, off_t start, off_t len) {
+    for (io61_lock_waiter* w : f->waiters) {
+        for (size_t i = 0; i != w->nranges; ++i) {
+            if (w->ranges[i].start < start + len
+                && start < w->ranges[i].start + w->ranges[i].len) {
+                w->cv.notify_one();
+                break;
+            }
+        }
+    }
+}
+
+// io61_count_lock(f, ranges, n, contended, waited, deadlock)
+//    Records a lock request in `f->lst` when statistics are on: it was
+//    acquired unless `deadlock`, and if `contended`, it waited `waited`
+//    seconds for the `n` ranges in `ranges`. Requires `f->rm`.
+
+static void io61_count_lock(io61_file* f, const io61_range* ranges, size_t n,
+                            bool contended, double waited, bool deadlock = false) {
+    if (!io61_stats_on) {
+        return;
+    }
+    io61_lock_stats& lst = f->lst;
+    ++(deadlock ? lst.ndeadlocks : lst.nacquired);
+    if (contended) {
+        ++lst.ncontended;
+        lst.wait_total += waited;
+        lst.wait_max = std::max(lst.wait_max, waited);
+        for (size_t i = 0; i != n; ++i) {
+            io61_range_heat& h = lst.hot[{ranges[i].start, ranges[i].len}];
+            ++h.ncontended;
+            h.wait += waited;
+        }
+    }
+}
+
+// io61_count_hold(f, l)
+//    Records in `f->lst` how long lock `l` was held, when statistics are
+//    on. Requires `f->rm`.
+
+static void io61_count_hold(io61_file* f, const io61_range_lock& l) {
+    if (!io61_stats_on) {
+        return;
+    }
+    double us = (io61_now() - l.acquired) * 1e6;
+    int bucket = 0;
+    while (bucket != io61_hold_buckets - 1 && us >= (double) (1UL << bucket)) {
+        ++bucket;
+    }
+    ++f->lst.hold_hist[bucket];
+}
+
+// lock_must_wait(f, ranges, n, locktype, seq)
+//    Returns true if this thread must wait for `locktype` locks on any of
+//    the `n` ranges in `ranges`, either because of a conflicting lock or
+//    because the lock policy queues it behind another waiter. `seq` is
+//    the request's arrival number (`ULONG_MAX` if it is not waiting yet).
+//    Requires `f->rm`.
+
+static bool lock_must_wait(io61_file* f, const io61_range* ranges, size_t n,
+                           int locktype, unsigned long seq) {
+    for (size_t i = 0; i != n; ++i) {
+        if (ranges[i].len != 0
+            && overlaps_with_other_lock(f, ranges[i].start, ranges[i].len,
+                                        locktype)) {
+            return true;
+        }
+    }
+    return !f->waiters.empty()
+        && queue_conflicts(f, ranges, n, locktype, std::this_thread::get_id(),
+                           seq, io61_lock_priority, nullptr);
+}
+
+// add_lock(f, start, len, locktype)
+//    Records a `locktype` lock on [start, start + len) held by this thread.
+//    The caller must hold `f->rm`.
+
+static void add_lock(io61_file* f, off_t start, off_t len, int locktype) {
+    f->locks.emplace(start, io61_range_lock{
+        len, std::this_thread::get_id(), locktype, io61_now()
+    });
+    f->max_lock_len = std::max(f->max_lock_len, len);
+}
+
 // io61_try_lock(f, start, len, locktype)
 //    Attempts to acquire a lock on offsets `[start, len)` in file `f`.
 //    `locktype` must be `LOCK_SH`, which requests a shared lock,
@@ -435,15 +1180,13 @@ int io61_try_lock(io61_file* f, off_t start, off_t len, int locktype) {
 
     // Check if pre-existing overlap
     std::unique_lock guard(f->rm);
-    if (overlaps_with_other_lock(f, start, len)) {
+    io61_range range{start, len};
+    if (lock_must_wait(f, &range, 1, locktype, ULONG_MAX)) {
         return -1;
     }
 
-    // Add new locked region
-    for (int ri = file_region(start); ri <= file_region(start + len - 1); ++ri) {
-        ++f->reg[ri].locked;
-        f->reg[ri].owner = std::this_thread::get_id();
-    }
+    add_lock(f, start, len, locktype);
+    io61_count_lock(f, nullptr, 0, false, 0);
     return 0;
 }
 
@@ -455,26 +1198,83 @@ int io61_try_lock(io61_file* f, off_t start, off_t len, int locktype) {
 //
 //    Returns 0 if the lock was acquired and -1 on error. Blocks until
 //    the lock can be acquired; the -1 return value is reserved for true
-//    error conditions, such as EDEADLK (a deadlock was detected).
+//    error conditions, such as EDEADLK (a deadlock was detected). Waiting
+//    would deadlock when the threads this request waits for are, directly
+//    or indirectly, waiting for a lock that this thread holds; the caller
+//    should then release its locks and retry.
 
 int io61_lock(io61_file* f, off_t start, off_t len, int locktype) {
-    assert(start >= 0 && len >= 0);
+    io61_range range{start, len};
+    return io61_lock_many(f, &range, 1, locktype);
+}
+
+
+// io61_lock_many(f, ranges, n, locktype)
+//    Acquire `locktype` locks on all `n` ranges in `ranges` at once, as
+//    if by `io61_lock` on each. No lock is taken until every range is
+//    available, so a thread that holds no other locks cannot deadlock
+//    here, whatever order the ranges are in; this replaces sorting the
+//    ranges before locking them one by one. The whole set is acquired in
+//    one critical section. Returns 0 on success and -1 on error, as for
+//    `io61_lock`; on error, no range is locked.
+
+int io61_lock_many(io61_file* f, const io61_range* ranges, size_t n,
+                   int locktype) {
     assert(locktype == LOCK_EX || locktype == LOCK_SH);
-    if (len == 0) {
-        return 0;
+    for (size_t i = 0; i != n; ++i) {
+        assert(ranges[i].start >= 0 && ranges[i].len >= 0);
     }
 
-    // Use cv to wait until no longer overlaps
+    // Wait on a private cv until no range overlaps
     std::unique_lock guard(f->rm);
-    while (overlaps_with_other_lock(f, start, len)) {
-        f->cv.wait(guard);
+    bool contended = lock_must_wait(f, ranges, n, locktype, ULONG_MAX);
+    double t0 = io61_now();
+    if (contended) {
+        // Announce a waiting writer so new readers queue behind it
+        std::vector<decltype(f->xwaiters)::iterator> ws;
+        if (locktype == LOCK_EX) {
+            for (size_t i = 0; i != n; ++i) {
+                if (ranges[i].len != 0) {
+                    ws.push_back(f->xwaiters.emplace(ranges[i].start, io61_range_lock{
+                        ranges[i].len, std::this_thread::get_id(), LOCK_EX
+                    }));
+                    f->max_lock_len = std::max(f->max_lock_len, ranges[i].len);
+                }
+            }
+        }
+        io61_lock_waiter me{
+            ranges, n, locktype, std::this_thread::get_id(), ++f->lock_seq,
+            io61_lock_priority, {}
+        };
+        auto it = f->waiters.insert(f->waiters.end(), &me);
+        bool deadlock = false;
+        do {
+            if ((deadlock = io61_lock_would_deadlock(f, &me))) {
+                break;
+            }
+            me.cv.wait(guard);
+        } while (lock_must_wait(f, ranges, n, locktype, me.seq));
+        f->waiters.erase(it);
+        for (auto w : ws) {
+            f->xwaiters.erase(w);
+        }
+        if (deadlock) {
+            // Others may have queued behind us
+            for (size_t i = 0; i != n; ++i) {
+                wake_waiters(f, ranges[i].start, ranges[i].len);
+            }
+            io61_count_lock(f, ranges, n, true, io61_now() - t0, true);
+            errno = EDEADLK;
+            return -1;
+        }
     }
 
-    // Insert new locked region into region map
-    for (int ri = file_region(start); ri <= file_region(start + len - 1); ++ri) {
-        ++f->reg[ri].locked;
-        f->reg[ri].owner = std::this_thread::get_id();
-    }    
+    for (size_t i = 0; i != n; ++i) {
+        if (ranges[i].len != 0) {
+            add_lock(f, ranges[i].start, ranges[i].len, locktype);
+        }
+    }
+    io61_count_lock(f, ranges, n, contended, io61_now() - t0);
     return 0;
 }
 
@@ -484,24 +1284,87 @@ int io61_lock(io61_file* f, off_t start, off_t len, int locktype) {
 //    Returns 0 on success and -1 on error.
 
 int io61_unlock(io61_file* f, off_t start, off_t len) {
-    (void) f;
-    assert(start >= 0 && len >= 0);
-    if (len == 0) {
-        return 0;
-    }
+    io61_range range{start, len};
+    return io61_unlock_many(f, &range, 1);
+}
+
+
+// io61_unlock_many(f, ranges, n)
+//    Release this thread's locks on all `n` ranges in `ranges`, as if by
+//    `io61_unlock` on each, in one critical section. Returns 0 on success
+//    and -1 if some range was not locked; the other ranges are still
+//    released.
 
-    // Release lock
+int io61_unlock_many(io61_file* f, const io61_range* ranges, size_t n) {
     std::unique_lock guard(f->rm);
-    for (int ri = file_region(start); ri <= file_region(start + len - 1); ++ri) {
-        --f->reg[ri].locked;
+    int r = 0;
+    for (size_t i = 0; i != n; ++i) {
+        off_t start = ranges[i].start, len = ranges[i].len;
+        assert(start >= 0 && len >= 0);
+        if (len == 0) {
+            continue;
+        }
+
+        // Release this thread's lock on exactly this range
+        auto [it, end] = f->locks.equal_range(start);
+        while (it != end
+               && (it->second.len != len
+                   || it->second.owner != std::this_thread::get_id())) {
+            ++it;
+        }
+        if (it == end) {
+            errno = EINVAL;
+            r = -1;
+            continue;
+        }
+        io61_count_hold(f, it->second);
+        f->locks.erase(it);
+
+        // Wake up threads waiting on overlapping ranges
+        wake_waiters(f, start, len);
     }
+    if (f->locks.empty() && f->xwaiters.empty()) {
+        f->max_lock_len = 0;
+    }
+    return r;
+}
+
 
-    // Wake up other threads
-    f->cv.notify_all();
+// io61_set_lock_policy(f, policy)
+//    Chooses how `f` serves threads waiting for range locks.
+//    `IO61_LOCK_BARGE` (the default) lets whichever thread gets there
+//    first take a free range, so a thread that keeps relocking a hot range
+//    can starve others. `IO61_LOCK_FIFO` serves conflicting requests for
+//    overlapping ranges in arrival order, and `IO61_LOCK_PRIORITY` serves
+//    higher `io61_set_lock_priority` values first, then arrival order.
+//    `IO61_LOCKPOLICY=fifo` or `=priority` in the environment sets the
+//    policy when a file is opened. Returns 0 on success and -1 on error.
+
+int io61_set_lock_policy(io61_file* f, int policy) {
+    if (policy != IO61_LOCK_BARGE
+        && policy != IO61_LOCK_FIFO
+        && policy != IO61_LOCK_PRIORITY) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::unique_lock guard(f->rm);
+    f->lock_policy = policy;
+    for (io61_lock_waiter* w : f->waiters) {
+        w->cv.notify_one();
+    }
     return 0;
 }
 
 
+// io61_set_lock_priority(priority)
+//    Sets the calling thread's priority for range locks on files that use
+//    `IO61_LOCK_PRIORITY`. Higher values go first; the default is 0.
+
+void io61_set_lock_priority(int priority) {
+    io61_lock_priority = priority;
+}
+
+
 // HELPER FUNCTIONS
 // You shouldn't need to change these functions.
 
@@ -36,8 +36,22 @@ int io61_try_lock(io61_file* f, off_t start, off_t len, int locktype);
 int io61_lock(io61_file* f, off_t start, off_t len, int locktype);
 int io61_unlock(io61_file* f, off_t start, off_t len);
 
+struct io61_range {
+    off_t start;
+    off_t len;
+};
+int io61_lock_many(io61_file* f, const io61_range* ranges, size_t n,
+                   int locktype);
+int io61_unlock_many(io61_file* f, const io61_range* ranges, size_t n);
+
+enum { IO61_LOCK_BARGE, IO61_LOCK_FIFO, IO61_LOCK_PRIORITY };
+int io61_set_lock_policy(io61_file* f, int policy);
+void io61_set_lock_priority(int priority);
+
 int io61_flush(io61_file* f);
 
+int io61_set_bufsize(io61_file* f, size_t sz);
+
 int fd_open_check(const char* filename, int mode);
 FILE* stdio_open_check(const char* filename, int mode);
 double monotonic_timestamp();
@@ -52,6 +66,12 @@ struct io61_args {
     bool flush = false;                 // `-F`: flush output
     bool quiet = false;                 // `-q`: ignore errors
     bool modify = false;                // `-M`: modify in place
+    bool exclusive = false;             // `-X`: exclusive locks only
+    bool memtable = false;              // `-T`: in-memory account table
+    bool optimistic = false;            // `-C`: optimistic transfers
+    const char* sync_policy = nullptr;  // `-S`: ledger sync policy
+    const char* wal_file = nullptr;     // `-W`: write-ahead log file
+    unsigned long commit_delay = 0;     // `-G`: group commit delay (usec)
     unsigned yield = 0;                 // `-y`: yield after output
     const char* output_file = nullptr;  // `-o`: output file
     const char* input_file = nullptr;   // input file
@@ -0,0 +1,114 @@
+#include "io61.hh"
+#include <sys/resource.h>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+
+// Usage: ./pcopy61 [-j NTHREADS] [-b CHUNKSIZE] -o OUTFILE FILE
+//    Copies FILE to OUTFILE using NTHREADS worker threads (default 4).
+//    The file is split into CHUNKSIZE-byte chunks (default 1MB), which
+//    workers claim in order and copy with `io61_pread` and `io61_pwrite`.
+//    CHUNKSIZE is rounded up to a multiple of the page size, the unit of
+//    positioned cache slots, so no two chunks share a slot. Each worker
+//    opens both files itself and writes only its own chunks.
+
+static std::atomic<size_t> next_chunk = 0;
+
+static void copy_thread(const io61_args& args, size_t filesize,
+                        size_t& ncopied) {
+    // Open private handles whose caches hold exactly one chunk
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    io61_file* outf = io61_open_check(args.output_file, O_RDWR);
+    int r = io61_set_bufsize(inf, args.block_size);
+    assert(r == 0);
+    r = io61_set_bufsize(outf, args.block_size);
+    assert(r == 0);
+    unsigned char* buf = new unsigned char[args.block_size];
+
+    ncopied = 0;
+    while (true) {
+        size_t off = next_chunk++ * args.block_size;
+        if (off >= filesize) {
+            break;
+        }
+        size_t len = std::min(args.block_size, filesize - off);
+
+        for (size_t n = 0; n != len; ) {
+            ssize_t nr = io61_pread(inf, &buf[n], len - n, off + n);
+            if (nr <= 0) {
+                fprintf(stderr, "pcopy61: %s: short read at offset %zu\n",
+                        args.input_file, off + n);
+                exit(1);
+            }
+            n += nr;
+        }
+        for (size_t n = 0; n != len; ) {
+            ssize_t nw = io61_pwrite(outf, &buf[n], len - n, off + n);
+            if (nw <= 0) {
+                fprintf(stderr, "pcopy61: %s: write error at offset %zu\n",
+                        args.output_file, off + n);
+                exit(1);
+            }
+            n += nw;
+        }
+        ncopied += len;
+    }
+
+    delete[] buf;
+    io61_close(inf);
+    io61_close(outf);
+}
+
+
+int main(int argc, char* argv[]) {
+    // Parse arguments
+    io61_args args = io61_args("b:i:o:j:", 1 << 20).set_nthreads(4)
+        .parse(argc, argv);
+    if (!args.input_file || !args.output_file) {
+        fprintf(stderr, "pcopy61: need named input and output files\n");
+        exit(1);
+    }
+    // Align chunks with cache slots
+    args.block_size = (args.block_size + 4095) & ~(size_t) 4095;
+
+    // Size the output up front so workers can write chunks in any order
+    io61_file* inf = io61_open_check(args.input_file, O_RDONLY);
+    off_t filesize = io61_filesize(inf);
+    io61_close(inf);
+    if (filesize < 0) {
+        fprintf(stderr, "pcopy61: %s: not a regular file\n", args.input_file);
+        exit(1);
+    }
+    int outfd = fd_open_check(args.output_file, O_WRONLY | O_CREAT | O_TRUNC);
+    if (ftruncate(outfd, filesize) != 0) {
+        fprintf(stderr, "pcopy61: %s: %s\n", args.output_file, strerror(errno));
+        exit(1);
+    }
+    close(outfd);
+    double start_time = monotonic_timestamp();
+
+    // Run workers
+    std::vector<std::thread> th(args.nthreads);
+    std::vector<size_t> ncopied(args.nthreads, 0);
+    for (int i = 0; i != args.nthreads; ++i) {
+        th[i] = std::thread(copy_thread, std::ref(args), (size_t) filesize,
+                            std::ref(ncopied[i]));
+    }
+
+    size_t total = 0;
+    for (int i = 0; i != args.nthreads; ++i) {
+        th[i].join();
+        total += ncopied[i];
+    }
+    assert(total == (size_t) filesize);
+
+    double end_time = monotonic_timestamp();
+    struct rusage usage;
+    int r = getrusage(RUSAGE_SELF, &usage);
+    assert(r == 0);
+    fprintf(stderr, "%d %s, %zu bytes, %d.%06ds CPU time, %.6fs real time, %.1f MB/s\n",
+            args.nthreads, args.nthreads == 1 ? "thread" : "threads", total,
+            (int) usage.ru_utime.tv_sec, (int) usage.ru_utime.tv_usec,
+            end_time - start_time,
+            total / std::max(end_time - start_time, 1e-9) / 1e6);
+}